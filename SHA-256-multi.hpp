@@ -0,0 +1,305 @@
+#ifndef INCLUDE_SHA_256_MULTI_HPP_
+#define INCLUDE_SHA_256_MULTI_HPP_
+
+#include "SHA-256.hpp"
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define SHA256_MULTI_X86 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+/*
+  Batched SHA-256 for many short messages (UIDs).
+
+  Every file needs a handful of digests of messages that are only one or two blocks
+  long. Instead of hashing them one after the other the messages are collected and
+  hashed together:
+    - with SHA-NI the CPU's SHA extensions do the rounds for one message at a time,
+    - with AVX-512 16 messages and with AVX2 8 messages are hashed in the lanes of a
+      vector register (multi-buffer), messages with fewer blocks are masked out once
+      they are done,
+    - otherwise the scalar SHA256 class is used.
+  The implementation is selected once at runtime. All paths produce the same digests
+  as SHA256::digestString.
+
+    SHA256::digest out[3];
+    std::string msgs[3] = { "1.2.3", "1.2.4", "1.2.5" };
+    SHA256Multi::digestMany(msgs, 3, out);
+*/
+namespace SHA256Multi {
+
+typedef SHA256::UInt32 UInt32;
+typedef SHA256::Byte Byte;
+
+static const UInt32 H0[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                             0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+// number of 64 byte blocks after padding (0x80 byte and 64bit length)
+inline size_t numBlocks(size_t length) { return (length + 9 + 63) / 64; }
+
+// copy block b of the padded message into out
+inline void paddedBlock(const Byte *msg, size_t length, size_t b, Byte out[64]) {
+  size_t start = b * 64;
+  size_t n = 0;
+  if (start < length) {
+    n = length - start < 64 ? length - start : 64;
+    memcpy(out, msg + start, n);
+  }
+  memset(out + n, 0, 64 - n);
+  if (start + n == length && n < 64) // the 0x80 follows the message
+    out[n] = 0x80;
+  if (b == numBlocks(length) - 1) { // last block has the length in bits, big-endian
+    uint64_t bits = (uint64_t)length * 8;
+    for (int i = 0; i < 8; i++)
+      out[56 + i] = (Byte)(bits >> (56 - 8 * i));
+  }
+}
+
+inline UInt32 load32be(const Byte *p) {
+  return ((UInt32)p[0] << 24) | ((UInt32)p[1] << 16) | ((UInt32)p[2] << 8) | (UInt32)p[3];
+}
+
+inline void storeDigest(const UInt32 state[8], SHA256::digest &out) {
+  for (int i = 0; i < 8; i++) {
+    out.data[i * 4 + 0] = (Byte)(state[i] >> 24);
+    out.data[i * 4 + 1] = (Byte)(state[i] >> 16);
+    out.data[i * 4 + 2] = (Byte)(state[i] >> 8);
+    out.data[i * 4 + 3] = (Byte)(state[i]);
+  }
+}
+
+inline void digestScalar(const std::string *msgs, size_t n, SHA256::digest *out) {
+  for (size_t i = 0; i < n; i++)
+    out[i] = SHA256::digestString(msgs[i]);
+}
+
+#ifdef SHA256_MULTI_X86
+
+// one message at a time with the SHA extensions (sha256rnds2/msg1/msg2)
+__attribute__((target("sha,sse4.1"))) inline void digestShaNi(const std::string *msgs, size_t n, SHA256::digest *out) {
+  const __m128i MASK = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+  Byte block[64];
+  for (size_t m = 0; m < n; m++) {
+    const Byte *data = (const Byte *)msgs[m].data();
+    size_t length = msgs[m].size();
+    // state is kept as ABEF and CDGH
+    __m128i tmp = _mm_loadu_si128((const __m128i *)&H0[0]);
+    __m128i state1 = _mm_loadu_si128((const __m128i *)&H0[4]);
+    tmp = _mm_shuffle_epi32(tmp, 0xB1);
+    state1 = _mm_shuffle_epi32(state1, 0x1B);
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+    size_t nblocks = numBlocks(length);
+    for (size_t b = 0; b < nblocks; b++) {
+      const Byte *p = data + b * 64;
+      if ((b + 1) * 64 > length) { // the block contains padding
+        paddedBlock(data, length, b, block);
+        p = block;
+      }
+      __m128i abef = state0, cdgh = state1;
+      __m128i w[4];
+      for (int i = 0; i < 4; i++)
+        w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 16 * i)), MASK);
+      for (int r = 0; r < 16; r++) { // 4 rounds each
+        __m128i msg = _mm_add_epi32(w[r & 3], _mm_loadu_si128((const __m128i *)&K[4 * r]));
+        state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+        msg = _mm_shuffle_epi32(msg, 0x0E);
+        state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+        if (r < 12) { // message schedule for rounds 4(r+4) .. 4(r+4)+3
+          __m128i t = _mm_sha256msg1_epu32(w[r & 3], w[(r + 1) & 3]);
+          t = _mm_add_epi32(t, _mm_alignr_epi8(w[(r + 3) & 3], w[(r + 2) & 3], 4));
+          w[r & 3] = _mm_sha256msg2_epu32(t, w[(r + 3) & 3]);
+        }
+      }
+      state0 = _mm_add_epi32(state0, abef);
+      state1 = _mm_add_epi32(state1, cdgh);
+    }
+    // back to ABCD EFGH
+    tmp = _mm_shuffle_epi32(state0, 0x1B);
+    state1 = _mm_shuffle_epi32(state1, 0xB1);
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+    state1 = _mm_alignr_epi8(state1, tmp, 8);
+    UInt32 state[8];
+    _mm_storeu_si128((__m128i *)&state[0], state0);
+    _mm_storeu_si128((__m128i *)&state[4], state1);
+    storeDigest(state, out[m]);
+  }
+}
+
+// The vector versions share the round function, only the type and the rotate differ.
+#define SHA256_MULTI_ROUNDS(V, ADD, XOR, AND, OR, ANDNOT, ROR, SHR, SET1)                                 \
+  for (int t = 0; t < 64; t++) {                                                                          \
+    V wt;                                                                                                 \
+    if (t < 16) {                                                                                         \
+      wt = w[t];                                                                                          \
+    } else {                                                                                              \
+      V w15 = w[(t - 15) & 15], w2 = w[(t - 2) & 15];                                                     \
+      V s0 = XOR(XOR(ROR(w15, 7), ROR(w15, 18)), SHR(w15, 3));                                            \
+      V s1 = XOR(XOR(ROR(w2, 17), ROR(w2, 19)), SHR(w2, 10));                                             \
+      wt = ADD(ADD(w[t & 15], s0), ADD(w[(t - 7) & 15], s1));                                             \
+      w[t & 15] = wt;                                                                                     \
+    }                                                                                                     \
+    V S1 = XOR(XOR(ROR(e, 6), ROR(e, 11)), ROR(e, 25));                                                   \
+    V ch = XOR(AND(e, f), ANDNOT(e, g));                                                                  \
+    V t1 = ADD(ADD(ADD(h, S1), ADD(ch, SET1((int)K[t]))), wt);                                            \
+    V S0 = XOR(XOR(ROR(a, 2), ROR(a, 13)), ROR(a, 22));                                                   \
+    V maj = OR(AND(a, b), AND(c, OR(a, b)));                                                              \
+    V t2 = ADD(S0, maj);                                                                                  \
+    h = g; g = f; f = e; e = ADD(d, t1);                                                                  \
+    d = c; c = b; b = a; a = ADD(t1, t2);                                                                 \
+  }
+
+// Multi-buffer: message i of a group goes into lane i. W is loaded transposed, so every
+// vector holds the same word of all lanes.
+template <int LANES, typename V, typename Compress>
+inline void digestLanes(const std::string *msgs, size_t n, SHA256::digest *out, Compress compress) {
+  alignas(64) UInt32 words[16][LANES];
+  alignas(64) UInt32 state[8][LANES];
+  alignas(64) UInt32 active[LANES];
+  Byte block[64];
+  for (size_t first = 0; first < n; first += LANES) {
+    size_t count = n - first < (size_t)LANES ? n - first : (size_t)LANES;
+    size_t maxBlocks = 0;
+    for (size_t l = 0; l < count; l++) {
+      size_t nb = numBlocks(msgs[first + l].size());
+      if (nb > maxBlocks)
+        maxBlocks = nb;
+    }
+    for (int i = 0; i < 8; i++)
+      for (int l = 0; l < LANES; l++)
+        state[i][l] = H0[i];
+    for (size_t b = 0; b < maxBlocks; b++) {
+      for (int l = 0; l < LANES; l++) {
+        bool inUse = (size_t)l < count && b < numBlocks(msgs[first + l].size());
+        active[l] = inUse ? 0xFFFFFFFF : 0;
+        if (!inUse) {
+          for (int i = 0; i < 16; i++)
+            words[i][l] = 0;
+          continue;
+        }
+        const std::string &msg = msgs[first + l];
+        const Byte *p = (const Byte *)msg.data() + b * 64;
+        if ((b + 1) * 64 > msg.size()) {
+          paddedBlock((const Byte *)msg.data(), msg.size(), b, block);
+          p = block;
+        }
+        for (int i = 0; i < 16; i++)
+          words[i][l] = load32be(p + 4 * i);
+      }
+      compress(words, state, active);
+    }
+    for (size_t l = 0; l < count; l++) {
+      UInt32 s[8];
+      for (int i = 0; i < 8; i++)
+        s[i] = state[i][l];
+      storeDigest(s, out[first + l]);
+    }
+  }
+}
+
+#define SHA256_MULTI_AVX2_ROR(x, n) _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - (n)))
+#define SHA256_MULTI_AVX2_ANDNOT(x, y) _mm256_andnot_si256(x, y)
+
+__attribute__((target("avx2"))) inline void compressAvx2(UInt32 words[16][8], UInt32 state[8][8], const UInt32 active[8]) {
+  __m256i w[16];
+  for (int i = 0; i < 16; i++)
+    w[i] = _mm256_load_si256((const __m256i *)words[i]);
+  __m256i s[8];
+  for (int i = 0; i < 8; i++)
+    s[i] = _mm256_load_si256((const __m256i *)state[i]);
+  __m256i a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+  SHA256_MULTI_ROUNDS(__m256i, _mm256_add_epi32, _mm256_xor_si256, _mm256_and_si256, _mm256_or_si256,
+                      SHA256_MULTI_AVX2_ANDNOT, SHA256_MULTI_AVX2_ROR, _mm256_srli_epi32, _mm256_set1_epi32)
+  __m256i mask = _mm256_load_si256((const __m256i *)active);
+  __m256i r[8] = {a, b, c, d, e, f, g, h};
+  for (int i = 0; i < 8; i++) // lanes that are done keep their state
+    _mm256_store_si256((__m256i *)state[i], _mm256_blendv_epi8(s[i], _mm256_add_epi32(s[i], r[i]), mask));
+}
+
+__attribute__((target("avx2"))) inline void digestAvx2(const std::string *msgs, size_t n, SHA256::digest *out) {
+  digestLanes<8, __m256i>(msgs, n, out, compressAvx2);
+}
+
+#define SHA256_MULTI_AVX512_ANDNOT(x, y) _mm512_andnot_si512(x, y)
+
+__attribute__((target("avx512f"))) inline void compressAvx512(UInt32 words[16][16], UInt32 state[8][16], const UInt32 active[16]) {
+  __m512i w[16];
+  for (int i = 0; i < 16; i++)
+    w[i] = _mm512_load_si512((const void *)words[i]);
+  __m512i s[8];
+  for (int i = 0; i < 8; i++)
+    s[i] = _mm512_load_si512((const void *)state[i]);
+  __m512i a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+  SHA256_MULTI_ROUNDS(__m512i, _mm512_add_epi32, _mm512_xor_si512, _mm512_and_si512, _mm512_or_si512,
+                      SHA256_MULTI_AVX512_ANDNOT, _mm512_ror_epi32, _mm512_srli_epi32, _mm512_set1_epi32)
+  __mmask16 k = _mm512_test_epi32_mask(_mm512_load_si512((const void *)active), _mm512_set1_epi32(-1));
+  __m512i r[8] = {a, b, c, d, e, f, g, h};
+  for (int i = 0; i < 8; i++) // lanes that are done keep their state
+    _mm512_store_si512((void *)state[i], _mm512_mask_add_epi32(s[i], k, s[i], r[i]));
+}
+
+__attribute__((target("avx512f"))) inline void digestAvx512(const std::string *msgs, size_t n, SHA256::digest *out) {
+  digestLanes<16, __m512i>(msgs, n, out, compressAvx512);
+}
+
+inline bool cpuHasShaNi() {
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+    return false;
+  return (ebx & (1u << 29)) && __builtin_cpu_supports("sse4.1") && __builtin_cpu_supports("ssse3");
+}
+
+#endif /* SHA256_MULTI_X86 */
+
+enum Implementation { SCALAR, SHANI, AVX2, AVX512 };
+
+// best implementation for this CPU, SHA-NI does a message faster than the vector units
+// do 8 or 16 of them
+inline Implementation detect() {
+#ifdef SHA256_MULTI_X86
+  __builtin_cpu_init();
+  if (cpuHasShaNi())
+    return SHANI;
+  if (__builtin_cpu_supports("avx512f"))
+    return AVX512;
+  if (__builtin_cpu_supports("avx2"))
+    return AVX2;
+#endif
+  return SCALAR;
+}
+
+inline Implementation &implementation() {
+  static Implementation impl = detect();
+  return impl;
+}
+
+inline const char *implementationName() {
+  switch (implementation()) {
+  case SHANI: return "sha-ni";
+  case AVX512: return "avx512 x16";
+  case AVX2: return "avx2 x8";
+  default: return "scalar";
+  }
+}
+
+// digest of each of the n messages, same result as SHA256::digestString(msgs[i])
+inline void digestMany(const std::string *msgs, size_t n, SHA256::digest *out) {
+  switch (implementation()) {
+#ifdef SHA256_MULTI_X86
+  case SHANI: digestShaNi(msgs, n, out); return;
+  case AVX512: digestAvx512(msgs, n, out); return;
+  case AVX2: digestAvx2(msgs, n, out); return;
+#endif
+  default: digestScalar(msgs, n, out); return;
+  }
+}
+
+} // namespace SHA256Multi
+
+#endif /* INCLUDE_SHA_256_MULTI_HPP_ */
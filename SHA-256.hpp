@@ -6,6 +6,9 @@ Single-file SHA-256 hash in C++
 http://cpansearch.perl.org/src/BJOERN/Compress-Deflate7-1.0/7zip/C/Sha256.c
 This code is based on public domain code from Wei Dai's Crypto++ library.
 */
+#ifndef INCLUDE_SHA_256_HPP_
+#define INCLUDE_SHA_256_HPP_
+
 #include <string.h> /* for size_t and memset (to zero) */
 #include <string> /* for std::string */
 
@@ -290,4 +293,6 @@ int main() {
 	std::cout<<"SHA256('a'): "<<SHA256::digestString("a").toHex()<<"\n";
 	return 0;
 }
-*/
\ No newline at end of file
+*/
+
+#endif /* INCLUDE_SHA_256_HPP_ */
\ No newline at end of file
@@ -12,7 +12,19 @@
 
   =========================================================================*/
 #include "SHA-256.hpp"
+#include "SHA-256-multi.hpp"
 #include "dateprocessing.h"
+#include "dateshift.h"
+#include "dirwalker.h"
+#include "durability.h"
+#include "elementvalue.h"
+#include "asyncio.h"
+#include "fileio.h"
+#include "journal.h"
+#include "scheduler.h"
+#include "taglookup.h"
+#include "uidformat.h"
+#include "uidcache.h"
 #include "gdcmAnonymizer.h"
 #include "gdcmAttribute.h"
 #include "gdcmDefs.h"
@@ -37,11 +49,16 @@
 #include <sys/types.h>
 #include <time.h>
 
+#include <algorithm>
+#include <cctype>
 #include <chrono>
 #include <map>
+#include <memory>
+#include <unordered_map>
 #include <unordered_set>
 #include <pthread.h>
 #include <regex>
+#include <sstream>
 #include <stdio.h>
 #include <thread>
 
@@ -50,9 +67,25 @@ namespace fs = std::filesystem;
 
 #cmakedefine VERSION_DATE "@VERSION_DATE@"
 
+// options for reading and writing the files
+struct IOOptions {
+  bool splicepixels = false; // read only up to PixelData and copy the pixel data from the input file
+  bool mmapinput = false;    // parse the input files from a memory mapping instead of an std::ifstream
+  bool hugepages = false;    // ask for transparent huge pages for the mapping
+  unsigned asyncdepth = 0;   // files read ahead and written in the background with io_uring (0: blocking I/O)
+  size_t prefetchfiles = 0;  // next files of a worker announced to the kernel with posix_fadvise (0: off)
+  uintmax_t prefetchwindow = 64 << 20; // at most this many bytes of them
+  DurabilityPolicy durability;         // --fsync, the files are always written to a temporary name and renamed
+  std::string journal;                 // record the processed files in this journal
+  bool resume = false;                 // skip the files the journal has as done
+  bool incremental = false;            // like resume, but only if their output exists and is up to date
+};
+
 struct threadparams {
-  const char **filenames;
+  const char **filenames; // all files, the scheduler decides which one this thread processes
   size_t nfiles;
+  WorkStealingScheduler *scheduler;
+  FileQueue *queue; // if set files are taken from this queue instead (streaming mode)
   char *scalarpointer;
   std::string outputdir;
   std::string patientid;
@@ -64,9 +97,19 @@ struct threadparams {
   bool byseries;
   int thread; // number of the thread
   bool old_style_uid;
-  // each thread will store here the study instance uid (original and mapped)
-  std::map<std::string, std::string> byThreadStudyInstanceUID;
-  std::map<std::string, std::string> byThreadSeriesInstanceUID;
+  ConcurrentMap *uids; // memo of hashed uids, shared by all threads
+  // all threads store here the study and series instance uids (original and mapped)
+  ConcurrentMap *studyMapping;
+  ConcurrentMap *seriesMapping;
+  ConcurrentMap *outputdirs; // series directories created so far (--byseries), shared by all threads
+  Journal *journal;          // NULL without --journal
+  OutputClaims *outputs;     // output files claimed by the threads, the first file that produces an output wins
+  size_t duplicates;         // files of this thread skipped because another file produced the same output
+  IOOptions io;
+  bool async;                 // set by the thread, io_uring could be used
+  AsyncFileIO::Stats iostats; // set by the thread when it is done
+  ReadAhead::Stats prefetchstats;
+  OutputCommitter::Stats commitstats;
 };
 
 int debug_level = 0;
@@ -900,24 +943,202 @@ nlohmann::json work = nlohmann::json::array({
 });
 
 
-std::map<std::string, int> workCache;
-void createWorkCache() {
-  for (int i = 0; i < work.size(); i++) {
-    std::string key = std::string(work[i][0]) + std::string(work[i][1]);
-    if (workCache.find(key) == workCache.end()) {
-      // add this entry
-      workCache.insert(std::pair<std::string, int>{key,i});
+// The rules in work are compiled once into this table before the files are processed.
+// Each rule has its tag parsed and the action resolved from the strings in work, so
+// applyWork only needs to switch on the action.
+enum RuleAction {
+  ACTION_SKIP,              // DeIdentificationMethodCodeSequence, only created if missing
+  ACTION_REGEXP,            // keep the capturing groups of the regular expression in what
+  ACTION_REPLACE,           // set to value (limited to the max length of the VR)
+  ACTION_SET,               // set to value as is (empty, YES, MODIFIED)
+  ACTION_REPLACE_EVEN,      // set to value (limited and padded to even length), fallback for unknown actions
+  ACTION_BODYPART,          // keep known body parts, replace others with BODYPART
+  ACTION_REMOVE,            // remove the element (only private tags)
+  ACTION_HASHUID_PROJECT,   // hashuid+PROJECTNAME
+  ACTION_HASHUID,           // hashuid
+  ACTION_HASH,              // hash
+  ACTION_KEEP,              // keep
+  ACTION_INCREMENTDATE,     // incrementdate
+  ACTION_INCREMENTDATETIME  // incrementdatetime
+};
+
+// some tags need extra work if they are hashed (output file name, mapping)
+enum RuleTarget { TARGET_OTHER, TARGET_SOPINSTANCEUID, TARGET_SERIESINSTANCEUID, TARGET_STUDYINSTANCEUID, TARGET_STUDYID };
+
+struct Rule {
+  gdcm::Tag tag;
+  gdcm::PrivateTag privateTag; // only valid if isPrivate, owner is taken from the name column
+  bool isPrivate;
+  RuleAction action;
+  RuleTarget target;
+  std::string which;           // name column of the rule
+  std::string what;            // action column of the rule (the regular expression for ACTION_REGEXP)
+  std::string value;           // value used by ACTION_REPLACE, ACTION_SET and ACTION_REPLACE_EVEN
+  bool createIfMissing;
+  bool memoize;                // hashed values are kept in the uid memo (not for per-instance UIDs, they never repeat)
+  // ACTION_REGEXP: what compiled once, shared read-only by all threads (NULL if what is not a valid regular expression)
+  std::shared_ptr<const std::regex> re;
+};
+
+std::vector<Rule> rules;
+TagLookup workCache; // tag (group << 16 | element) to the index in rules
+
+// The order of the tests follows the order in which applyWork used to compare the strings,
+// the first match wins.
+static Rule compileRule(const nlohmann::json &entry, const std::string &projectname, const std::string &patientid, const std::string &eventname,
+                        const std::string &sitename) {
+  Rule rule;
+  std::string tag1(entry[0]);
+  std::string tag2(entry[1]);
+  rule.which = std::string(entry[2]);
+  rule.what = "replace";
+  if (entry.size() > 3)
+    rule.what = std::string(entry[3]);
+  bool regexp = entry.size() > 4 && entry[4] == "regexp";
+  rule.createIfMissing = entry.size() > 5 && entry[5] == "createIfMissing";
+
+  int a = strtol(tag1.c_str(), NULL, 16);
+  int b = strtol(tag2.c_str(), NULL, 16);
+  rule.tag = gdcm::Tag(a, b);
+  rule.isPrivate = rule.tag.IsPrivate();
+  if (rule.isPrivate)
+    rule.privateTag = gdcm::PrivateTag(a, b, rule.which.c_str()); // 0x71,0x22, "SIEMENS MED PT"
+
+  const std::string &which = rule.which;
+  const std::string &what = rule.what;
+  rule.target = TARGET_OTHER;
+  if (which == "SOPInstanceUID")
+    rule.target = TARGET_SOPINSTANCEUID;
+  else if (which == "SeriesInstanceUID")
+    rule.target = TARGET_SERIESINSTANCEUID;
+  else if (which == "StudyInstanceUID")
+    rule.target = TARGET_STUDYINSTANCEUID;
+  else if (which == "StudyID")
+    rule.target = TARGET_STUDYID;
+  // SOPInstanceUID and ReferencedSOPInstanceUID are (nearly) unique per file, the memo would only grow
+  rule.memoize = !(rule.tag == gdcm::Tag(0x0008, 0x0018) || rule.tag == gdcm::Tag(0x0008, 0x1155));
+
+  rule.action = ACTION_REPLACE_EVEN;
+  rule.value = what;
+  if (which == "DeIdentificationMethodCodeSequence") {
+    rule.action = ACTION_SKIP;
+  } else if (regexp) {
+    rule.action = ACTION_REGEXP;
+    try {
+      rule.re = std::make_shared<const std::regex>(what, std::regex::ECMAScript | std::regex::optimize);
+    } catch (std::regex_error &e) {
+      // the value of matching elements is set to empty, like before
+      if (debug_level > 0)
+        fprintf(stderr, "Warning: invalid regular expression for %s,%s %s: \"%s\" (%s)\n", tag1.c_str(), tag2.c_str(), rule.which.c_str(),
+                what.c_str(), e.what());
     }
+  } else if (which == "BlockOwner" && what != "replace") {
+    rule.action = ACTION_REPLACE;
+    rule.value = what;
+  } else if (which == "ProjectName" || which == "PROJECTNAME") {
+    rule.action = ACTION_REPLACE;
+    rule.value = projectname;
+  } else if (which == "PatientID" || which == "PATIENTID") {
+    rule.action = ACTION_REPLACE;
+    rule.value = patientid;
+  } else if (what == "ProjectName" || what == "PROJECTNAME") {
+    rule.action = ACTION_REPLACE;
+    rule.value = projectname;
+  } else if (what == "PatientID" || what == "PATIENTID") {
+    rule.action = ACTION_REPLACE;
+    rule.value = patientid;
+  } else if (what == "EventName" || what == "EVENTNAME") {
+    rule.action = ACTION_REPLACE;
+    rule.value = eventname;
+  } else if (which == "BodyPartExamined" && what == "BODYPART") {
+    rule.action = ACTION_BODYPART;
+  } else if (what == "replace") {
+    rule.action = ACTION_REPLACE;
+    rule.value = which;
+  } else if (what == "remove") {
+    rule.action = ACTION_REMOVE;
+  } else if (what == "empty") {
+    rule.action = ACTION_SET;
+    rule.value = "";
+  } else if (what == "hashuid+PROJECTNAME") {
+    rule.action = ACTION_HASHUID_PROJECT;
+  } else if (what == "hashuid") {
+    rule.action = ACTION_HASHUID;
+  } else if (what == "hash") {
+    rule.action = ACTION_HASH;
+  } else if (what == "keep") {
+    rule.action = ACTION_KEEP;
+  } else if (what == "incrementdate") {
+    rule.action = ACTION_INCREMENTDATE;
+  } else if (what == "incrementdatetime") {
+    rule.action = ACTION_INCREMENTDATETIME;
+  } else if (what == "YES") {
+    rule.action = ACTION_SET;
+    rule.value = "YES ";
+  } else if (what == "MODIFIED") {
+    rule.action = ACTION_SET;
+    rule.value = "MODIFIED";
+  } else if (what == "SITENAME") {
+    rule.action = ACTION_REPLACE;
+    rule.value = sitename;
   }
+  return rule;
 }
 
-std::string limitToMaxLength(gdcm::Tag t, std::string& str_in, const gdcm::DataSet& ds) {
-  const gdcm::DataElement& de = ds.GetDataElement(t);
-  gdcm::VR vr = de.GetVR();
-  std::string VRName = gdcm::VR::GetVRString(vr);
+// Group or element of a --tagchange/--regtagchange key as 4 lowercase hex digits, the way the
+// build-in rules are written. Rules are looked up by the numeric tag, so "300A", "300a" or "10"
+// and "0010" name the same group, the key is normalized here so it also replaces the build-in
+// rule for that tag instead of adding a second rule that is never used. Returns false if s is not
+// 1 to 4 hex digits.
+static bool canonicalTagPart(const std::string &s, std::string &out) {
+  if (s.empty() || s.size() > 4 || s.find_first_not_of("0123456789abcdefABCDEF") != std::string::npos)
+    return false;
+  char buf[8];
+  snprintf(buf, sizeof(buf), "%04lx", strtoul(s.c_str(), NULL, 16));
+  out = buf;
+  return true;
+}
 
-  if (VRName == "??") // don't know, do nothing
-    return std::string(str_in);
+// Needs to be called after all --tagchange/--regtagchange options have been applied to work.
+void compileRules(const std::string &projectname, const std::string &patientid, const std::string &eventname, const std::string &sitename) {
+  rules.clear();
+  workCache.clear();
+  for (int i = 0; i < work.size(); i++) {
+    rules.push_back(compileRule(work[i], projectname, patientid, eventname, sitename));
+    workCache.add(rules[i].tag.GetElementTag(), i); // only the first rule for a tag is used
+  }
+  workCache.finalize();
+}
+
+// maximum length of a value for the VR, 0 for VRs we do not limit
+static uint32_t maxLengthForVR(gdcm::VR::VRType vr) {
+  switch (vr) {
+  case gdcm::VR::AE: return 16;
+  case gdcm::VR::AS: return 4;
+  case gdcm::VR::AT: return 4;
+  case gdcm::VR::CS: return 16;
+  case gdcm::VR::DA: return 8;
+  case gdcm::VR::DS: return 16;
+  case gdcm::VR::DT: return 26;
+  case gdcm::VR::FL: return 4;
+  case gdcm::VR::FD: return 8;
+  case gdcm::VR::IS: return 12;
+  case gdcm::VR::LO: return 64;
+  case gdcm::VR::LT: return 10240;
+  case gdcm::VR::SH: return 16;
+  case gdcm::VR::SL: return 4;
+  case gdcm::VR::SS: return 2;
+  case gdcm::VR::ST: return 1024;
+  case gdcm::VR::TM: return 16;
+  case gdcm::VR::UI: return 64;
+  case gdcm::VR::UL: return 4;
+  case gdcm::VR::US: return 2;
+  default: return 0; // don't know (or composite VR like US_SS), do nothing
+  }
+}
+
+std::string_view limitToMaxLength(const gdcm::DataElement& de, std::string_view str_in) {
+  gdcm::VR vr = de.GetVR();
 
   /*if (str_in.size()%2!=0) { // odd length for this value, make even length by adding null or space
     if (VRName != "UI") { 
@@ -926,50 +1147,28 @@ std::string limitToMaxLength(gdcm::Tag t, std::string& str_in, const gdcm::DataS
       str_in += '\0';
     }
     }*/
-  
-  std::unordered_map<std::string, uint32_t> max_lengths = {
-    {"AE", 16},
-    {"AS", 4},
-    {"AT", 4},
-    {"CS", 16},
-    {"DA", 8},
-    {"DS", 16},
-    {"DT", 26},
-    {"FL", 4},
-    {"FD", 8},
-    {"IS", 12},
-    {"LO", 64},
-    {"LT", 10240},
-    {"SH", 16},
-    {"SL", 4},
-    {"SS", 2},
-    {"ST", 1024},
-    {"TM", 16},
-    {"UI", 64},
-    {"UL", 4},
-    {"US", 2}
-  };
-
-  auto max_length_it = max_lengths.find(VRName);
-  if (max_length_it == max_lengths.end())
-    return std::string(str_in); // do nothing
 
   // some elements need a space to get to even length, some need a null byte
   // see: https://dicom.nema.org/dicom/2013/output/chtml/part05/sect_6.2.html
 
-  uint32_t max_l = max_length_it->second;
-  if (max_l == 0)
-    return std::string(str_in); // should never happen
+  uint32_t max_l = maxLengthForVR((gdcm::VR::VRType)vr);
+  if (max_l == 0 || str_in.length() <= max_l)
+    return str_in;
 
-  if (str_in.length() > max_l) {
-    std::string str_limited = str_in.substr(0, max_l);
-    if (debug_level > 2)
-      fprintf(stderr, "Warning: tag (%04x,%04x) value too long (%zu), max: %u for VR: %s, will be truncated.\n",
-              t.GetGroup(), t.GetElement(), str_in.length(), max_l, gdcm::VR::GetVRString(vr));
-    return str_limited;
+  if (debug_level > 2) {
+    gdcm::Tag t = de.GetTag();
+    fprintf(stderr, "Warning: tag (%04x,%04x) value too long (%zu), max: %u for VR: %s, will be truncated.\n",
+            t.GetGroup(), t.GetElement(), str_in.length(), max_l, gdcm::VR::GetVRString(vr));
   }
+  return str_in.substr(0, max_l);
+}
+
+std::string limitToMaxLength(const gdcm::DataElement& de, const std::string& str_in) {
+  return std::string(limitToMaxLength(de, std::string_view(str_in)));
+}
 
-  return std::string(str_in);
+std::string limitToMaxLength(gdcm::Tag t, const std::string& str_in, const gdcm::DataSet& ds) {
+  return limitToMaxLength(ds.GetDataElement(t), str_in);
 }
 
 /*std::string limitToMaxLength(gdcm::Tag t, std::string str_in, gdcm::DataSet &ds) {
@@ -1036,212 +1235,327 @@ std::string limitToMaxLength(gdcm::Tag t, std::string& str_in, const gdcm::DataS
   return str_in;
 }*/
 
-// The TeraRecon workstation rejects images with StudyInstanceUIDs that
-// do not contains some dots and numbers only. We should be closer to the
-// standard if we start with our organizational root.
-//
-// We still do not fulfil the standard (http://dicom.nema.org/dicom/2013/output/chtml/part05/chapter_9.html)
-// because only 0-9 characters are allowed.
-
-// We have a second case for UIDs outside the standard creating problems.
-// The Screenpoint software also tests for the standard on UIDs before the
-// any processing is done.
-
-// toDec() stupid attempt because 0-5 will be more often in the data compared to 6-9
-std::string toDec(SHA256::Byte *data, int size) {
-	std::string ret="";
-	const char *decdigit="0123456789012345";
-	for (int i=0;i<size;i++) {
-		ret+=decdigit[(data[i]>>4)&0xf]; // high 4 bits
-		ret+=decdigit[(data[i]   )&0xf]; // low 4 bits
-	}
-	return ret;
-}
-
-std::string betterUID(std::string val, bool old_style_uid=false) {
-  std::string prefix = "1.3.6.1.4.1.45037"; // organizational prefix for us
-  std::string hash = "";  
-  if (old_style_uid) { // hexadecimal characters in UID (against standard for DICOM UIDs!)
-    hash = SHA256::digestString(val).toHex();
-  } else { // new style replacing alphas with numeric characters
-    SHA256::digest a = SHA256::digestString(val);
-    hash = toDec(a.data, a.size);
-  }
-  std::string phash = prefix + "." + hash;
-  return phash.substr(0,63); // bummer: this truncates our hash value, should be 64
-}
-
-// A date calculation using std::chrono. This function requires at least c++20!
-void addDays(struct sdate &date1, int days) {
-
-  // try this with chrono instead
-  std::chrono::year_month_day _ymd(std::chrono::year(date1.y), std::chrono::month(date1.m), std::chrono::day(date1.d));
-  // fprintf(stdout, "%d %d %d\n", static_cast<int>(_ymd.year()), static_cast<unsigned>(_ymd.month()), static_cast<unsigned>(_ymd.day()));
-  // add some days
-  _ymd = std::chrono::sys_days{_ymd} + std::chrono::days{days};
-  // fprintf(stdout, "42 days later: %d %d %d\n", static_cast<int>(_ymd.year()), static_cast<unsigned>(_ymd.month()), static_cast<unsigned>(_ymd.day()));
-  date1.y = static_cast<int>(_ymd.year());
-  date1.m = static_cast<unsigned>(_ymd.month());
-  date1.d = static_cast<unsigned>(_ymd.day());
-  return;
-}
-
-
-
-// if true it indicates that some work was done
-bool applyWork(gdcm::DataElement de,
-         gdcm::Anonymizer &anon,
-	       gdcm::DataSet &ds,
-	       int work_idx,
-	       threadparams *params,
-	       const std::string trueStudyInstanceUID,
-	       const std::string filename,
-	       std::string &filenamestring,
-	       std::string &seriesdirname) {
-  gdcm::File &fileToAnon = anon.GetFile();
-  //gdcm::DataSet &ds = fileToAnon.GetDataSet();
-  
+// State of the anonymization of a single file. Each worker thread creates one context in
+// ReadFilesThread and calls reset() for every file, the context is passed down the recursion
+// into the sequences. This way the gdcm helpers are not created again for every data element.
+struct AnonContext {
+  threadparams *params;
+  gdcm::Anonymizer anon;
   gdcm::StringFilter sf;
-  sf.SetFile(fileToAnon);
-  
   gdcm::MediaStorage ms;
-  ms.SetFromFile(fileToAnon);
-  
-  //  for (int i = 0; i < work.size(); i++) {
-  // fprintf(stdout, "convert tag: %d/%lu\n", i, work.size());
-  std::string tag1(work[work_idx][0]);
-  std::string tag2(work[work_idx][1]);
-  std::string which(work[work_idx][2]);
-  std::string what("replace");
-  bool regexp = false;
-  if (work[work_idx].size() > 3) {
-    what = work[work_idx][3];
+  gdcm::File *file;                 // the file that is processed
+  std::string filename;             // input file
+  std::string trueStudyInstanceUID; // StudyInstanceUID from the root of the data set
+  std::string modality;             // Modality from the root of the data set, prefix of the output file name
+  std::string filenamestring;       // hashed SOPInstanceUID, used as output file name
+  std::string seriesdirname;        // hashed SeriesInstanceUID, used as output directory (byseries)
+  // Dictionary VRs of public tags, only used to find sequences. The dictionary does not change
+  // during a run so this is kept for all files of the thread.
+  std::unordered_map<uint32_t, gdcm::VR> vrs;
+  gdcm::SmartPointer<gdcm::File> nofile; // empty file, set while no file is processed
+  // Digests of the values that are hashed in this file. They are collected before the rules
+  // are applied and computed in one batch (SHA256Multi), applyWork picks them up by value.
+  std::vector<std::string> hashInputs;
+  std::vector<SHA256::digest> hashDigests;
+  std::unordered_map<std::string, size_t> hashIndex;
+  DateShifter dates; // incrementdate and incrementdatetime, --dateincrement is fixed for the run
+
+  AnonContext(threadparams *params) : params(params), nofile(new gdcm::File), dates(params->dateincrement) { file = nofile; }
+
+  void reset(gdcm::File &file, const char *fn) {
+    anon.SetFile(file);
+    sf.SetFile(file);
+    ms.SetFromFile(file);
+    this->file = &file;
+    filename = fn;
+    trueStudyInstanceUID.clear();
+    modality.clear();
+    filenamestring.clear();
+    seriesdirname.clear();
+    hashInputs.clear();
+    hashDigests.clear();
+    hashIndex.clear();
   }
-  int a = strtol(tag1.c_str(), NULL, 16);
-  int b = strtol(tag2.c_str(), NULL, 16);
 
-  gdcm::Tag hTag(a,b); // either hTag or phTag, better to use a union here
-  gdcm::PrivateTag phTag;
-  bool isPrivateTag = false;
-  if (hTag.IsPrivate()) {
-    phTag = gdcm::PrivateTag(a,b,which.c_str()); // 0x71,0x22, "SIEMENS MED PT"
-    isPrivateTag = true;
-    //fprintf(stderr, "looking now for a PRIVATE TAG AS %04x,%04x %s what: %s isPrivateTag: %s\n", a, b, which.c_str(), what.c_str(), isPrivateTag?"private":"public");
+  void addHashInput(const std::string &msg) {
+    if (hashIndex.insert(std::make_pair(msg, hashInputs.size())).second)
+      hashInputs.push_back(msg);
   }
-  
-  if (which == "DeIdentificationMethodCodeSequence")
-    return false; // already handeled above, nothing is done
-  
-  if (work[work_idx].size() > 4 && work[work_idx][4] == "regexp") {
-    regexp = true;
-    // as a test print out what we got
-    if (isPrivateTag?ds.FindDataElement(phTag):ds.FindDataElement(hTag)) {
-      gdcm::DataElement de1 = ds.GetDataElement( hTag );
-      const gdcm::ByteValue *bv4 = de1.GetByteValue();
-      char dat[256];
-      
-      
-      std::string val = sf.ToString(hTag);
-      std::string ns("");
-      try {
-        std::regex re(what);
-        std::smatch match;
-        if (std::regex_search(val, match, re) && match.size() > 1) {
-          for (int j = 1; j < match.size(); j++) {
-            ns += match.str(j) + std::string(" ");
+
+  // All values in ds (including sequences) that a hash rule will be applied to. A sequence that
+  // is still stored as raw bytes is parsed here and its element keeps the parsed items (like
+  // AnonymizeBasedOnWork does at the end), so the sequence is not parsed a second time there.
+  void collectHashInputs(gdcm::File const &file, gdcm::DataSet &ds) {
+    for (gdcm::DataSet::ConstIterator it = ds.Begin(); it != ds.End(); ++it) {
+      const gdcm::DataElement &de = *it;
+      if (computeVR(file, ds, de.GetTag()).Compatible(gdcm::VR::SQ)) {
+        gdcm::SmartPointer<gdcm::SequenceOfItems> sq = de.GetValueAsSQ();
+        if (sq) {
+          if (de.GetByteValue()) { // only the value changes, the key in the set stays the same
+            gdcm::DataElement &mde = const_cast<gdcm::DataElement &>(de);
+            mde.SetValue(*sq);
+            mde.SetVLToUndefined();
           }
-        } else {
-          ns = std::string("FIONA: no match on regular expression");
+          for (gdcm::SequenceOfItems::SizeType i = 1; i <= sq->GetNumberOfItems(); i++)
+            collectHashInputs(file, sq->GetItem(i).GetNestedDataSet());
         }
-      } catch (std::regex_error &e) {
-        if (debug_level > 0)
-          fprintf(stderr, "ERROR: regular expression match failed on %s,%s which: %s what: %s old: %s new: %s\n", tag1.c_str(), tag2.c_str(), which.c_str(),
-            what.c_str(), val.c_str(), ns.c_str());
+        continue;
       }
-      // fprintf(stdout, "show: %s,%s which: %s what: %s old: %s new: %s\n", tag1.c_str(), tag2.c_str(), which.c_str(), what.c_str(), val.c_str(),
-      // ns.c_str());
-      ns = limitToMaxLength(hTag, ns, ds);
-      de1.SetByteValue( ns.c_str(), (uint32_t)ns.size() );
-      ds.Replace( de1 );
-      // anon.Replace(isPrivateTag?phTag:hTag, limitToMaxLength(hTag, ns, ds).c_str());
+      int wi = workCache.find(de.GetTag().GetElementTag());
+      if (wi < 0)
+        continue;
+      const Rule &rule = rules[wi];
+      if (rule.isPrivate || (rule.action != ACTION_HASH && rule.action != ACTION_HASHUID && rule.action != ACTION_HASHUID_PROJECT))
+        continue;
+      const gdcm::ByteValue *bv = de.GetByteValue();
+      if (!bv)
+        continue;
+      std::string val(bv->GetPointer(), bv->GetLength());
+      bool withPrefix = (rule.action == ACTION_HASHUID_PROJECT);
+      if (withPrefix)
+        val += params->projectname;
+      if (!rule.memoize || !params->uids->contains(uidKey(withPrefix, params->old_style_uid, val))) // hashed by an earlier file
+        addHashInput(val);
     }
-    return true;
   }
-  if (which == "BlockOwner" && what != "replace") {
-    if (isPrivateTag?ds.FindDataElement(phTag):ds.FindDataElement(hTag)) {
-      gdcm::DataElement de1 = ds.GetDataElement( hTag );
-      std::string val = limitToMaxLength(hTag, what, ds);
-      de1.SetByteValue( val.c_str(), (uint32_t)val.size() );
-      ds.Replace( de1 );
-      return true;
+
+  // compute the digests for this file in one batch
+  void prehash(gdcm::File const &file, gdcm::DataSet &ds) {
+    collectHashInputs(file, ds);
+    // StudyID is hashed from the root StudyInstanceUID
+    std::string studyID = trueStudyInstanceUID + params->projectname;
+    if (!params->uids->contains(uidKey(false, params->old_style_uid, studyID)))
+      addHashInput(studyID);
+    hashDigests.resize(hashInputs.size());
+    SHA256Multi::digestMany(hashInputs.data(), hashInputs.size(), hashDigests.data());
+  }
+
+  // digest from the batch, values we did not expect are hashed here
+  SHA256::digest digest(const std::string &msg) {
+    auto it = hashIndex.find(msg);
+    if (it != hashIndex.end() && it->second < hashDigests.size())
+      return hashDigests[it->second];
+    return SHA256::digestString(msg);
+  }
+
+  // key for the uid memo, a uid depends on the hashed value, the prefix and the style
+  static std::string uidKey(bool withPrefix, bool old_style_uid, const std::string &msg) {
+    std::string key;
+    key.reserve(msg.size() + 2);
+    key += withPrefix ? 'U' : 'H';
+    key += old_style_uid ? 'x' : 'd';
+    key += msg;
+    return key;
+  }
+
+  // hashed uid for msg (betterUID if withPrefix) in buf, computed only once per run if memoize
+  std::string_view hashedUID(bool withPrefix, const std::string &msg, bool old_style_uid, UIDBuffer &buf, bool memoize = true) {
+    if (!memoize)
+      return formatUID(digest(msg), old_style_uid, withPrefix, buf);
+    std::string key = uidKey(withPrefix, old_style_uid, msg);
+    if (params->uids->find(key, [&buf](const std::string &uid) { buf.length = uid.copy(buf.data, sizeof(buf.data)); }))
+      return buf.view();
+    formatUID(digest(msg), old_style_uid, withPrefix, buf);
+    params->uids->insert(key, std::string(buf.view()));
+    return buf.view();
+  }
+
+  // anon and sf keep a reference to the file, drop it so the memory of the file is freed with the reader
+  void release() {
+    anon.SetFile(*nofile);
+    sf.SetFile(*nofile);
+    file = nofile;
+  }
+
+  // The value of de the way StringFilter::ToString returns it for text VRs (up to the first NUL,
+  // the padding is kept) without the dictionary lookup and the copy. It is the value of de
+  // itself, sf looks the tag up in the root data set even for elements inside sequences. Binary
+  // VRs and elements without a byte value are converted by sf into scratch.
+  std::string_view textValue(gdcm::DataSet const &ds, const gdcm::DataElement &de, std::string &scratch) {
+    gdcm::VR vr = de.GetVR();
+    if (vr == gdcm::VR::INVALID || vr == gdcm::VR::UN) // implicit VR, the dictionary knows
+      vr = computeVR(*file, ds, de.GetTag());
+    const gdcm::ByteValue *bv = de.GetByteValue();
+    if (bv && gdcm::VR::IsASCII(vr)) {
+      std::string_view v(bv->GetPointer(), bv->GetLength());
+      return v.substr(0, v.find('\0'));
     }
-    return false;
+    scratch = sf.ToString(de.GetTag());
+    return scratch;
   }
-  if (which == "ProjectName" || which == "PROJECTNAME") {
-    if (isPrivateTag?ds.FindDataElement(phTag):ds.FindDataElement(hTag)) {
-      gdcm::DataElement de1 = ds.GetDataElement( hTag );
-      std::string val = limitToMaxLength(hTag, params->projectname, ds);
-      de1.SetByteValue( val.c_str(), (uint32_t)val.size() );
-      ds.Replace( de1 );
-      return true;
+
+  // Values the thread needs from the root of the data set before the rules are applied, read
+  // with one lookup each. Only the root is searched, a StudyInstanceUID inside a sequence (like
+  // 0008,1200) is just a reference.
+  void readRoot(gdcm::DataSet const &ds) {
+    if (const gdcm::DataElement *de = rootElement(ds, gdcm::Tag(0x0020, 0x000d)))
+      trueStudyInstanceUID = printedValue(*de);
+    if (const gdcm::DataElement *de = rootElement(ds, gdcm::Tag(0x0008, 0x0060))) {
+      std::string scratch;
+      modality = textValue(ds, *de, scratch);
     }
-    return false;
   }
-  if (which == "PatientID" || which == "PATIENTID") {
-    if (isPrivateTag?ds.FindDataElement(phTag):ds.FindDataElement(hTag)) {
-      gdcm::DataElement de1 = ds.GetDataElement( hTag );
-      std::string val = limitToMaxLength(hTag, params->patientid, ds);
-      de1.SetByteValue( val.c_str(), (uint32_t)val.size() );
-      ds.Replace( de1 );
-      return true;
+
+  // The hashed SOPInstanceUID (output file name) and SeriesInstanceUID (directory with
+  // --byseries) of the root, computed like the hash rules for them do it. They are known right
+  // after the header is read, a copy of an instance that was processed before is skipped
+  // before the rules run. Elements inside sequences do not change the names.
+  void readOutputNames(gdcm::DataSet const &ds) {
+    filenamestring = rootHash(ds, TARGET_SOPINSTANCEUID);
+    seriesdirname = rootHash(ds, TARGET_SERIESINSTANCEUID);
+  }
+
+  // the value of the root element of the rule for target after that rule, empty if the rule
+  // does not hash it or the element is missing
+  std::string rootHash(gdcm::DataSet const &ds, RuleTarget target) {
+    for (size_t i = 0; i < rules.size(); i++) {
+      const Rule &rule = rules[i];
+      if (rule.target != target || rule.isPrivate || workCache.find(rule.tag.GetElementTag()) != (int)i)
+        continue;
+      if (rule.action != ACTION_HASH && rule.action != ACTION_HASHUID && rule.action != ACTION_HASHUID_PROJECT)
+        return std::string();
+      const gdcm::DataElement *de = rootElement(ds, rule.tag);
+      if (!de)
+        return std::string();
+      const gdcm::ByteValue *bv = de->GetByteValue();
+      std::string val = bv ? std::string(bv->GetPointer(), bv->GetLength()) : sf.ToString(rule.tag);
+      bool withPrefix = (rule.action == ACTION_HASHUID_PROJECT);
+      if (withPrefix)
+        val += params->projectname;
+      UIDBuffer buf;
+      return std::string(hashedUID(withPrefix, val, params->old_style_uid, buf, rule.memoize));
     }
-    return false;
+    return std::string();
   }
-  if (what == "ProjectName" || what == "PROJECTNAME") {
-    if (isPrivateTag?ds.FindDataElement(phTag):ds.FindDataElement(hTag)) {
-      gdcm::DataElement de1 = ds.GetDataElement( hTag );
-      std::string val = limitToMaxLength(hTag, params->projectname, ds);
-      de1.SetByteValue( val.c_str(), (uint32_t)val.size() );
-      ds.Replace( de1 );
-      return true;
+
+  // the element with tag in ds itself (not in its sequences) or NULL
+  static const gdcm::DataElement *rootElement(gdcm::DataSet const &ds, const gdcm::Tag &tag) {
+    gdcm::DataSet::ConstIterator it = ds.GetDES().find(gdcm::DataElement(tag));
+    return it == ds.GetDES().end() ? NULL : &*it;
+  }
+
+  // true if ds has an element of this group
+  static bool hasGroup(gdcm::DataSet const &ds, uint16_t group) {
+    gdcm::DataSet::ConstIterator it = ds.GetDES().lower_bound(gdcm::DataElement(gdcm::Tag(group, 0)));
+    return it != ds.GetDES().end() && it->GetTag().GetGroup() == group;
+  }
+
+  // The value the way gdcm::Value::Print shows it, the hashes of the StudyID depend on it: the
+  // bytes without a trailing NUL if all of them are printable, anything else is printed by gdcm.
+  static std::string printedValue(const gdcm::DataElement &de) {
+    const gdcm::ByteValue *bv = de.GetByteValue();
+    if (bv && bv->GetPointer() && bv->GetLength() > 0) {
+      const char *p = bv->GetPointer();
+      size_t n = bv->GetLength();
+      bool printable = true;
+      for (size_t i = 0; i < n && printable; i++)
+        printable = (i == n - 1 && p[i] == '\0') || isprint((unsigned char)p[i]) || isspace((unsigned char)p[i]);
+      if (printable)
+        return std::string(p, p[n - 1] == '\0' ? n - 1 : n);
     }
-    return false;
+    std::stringstream strm;
+    de.GetValue().Print(strm);
+    return strm.str();
+  }
+
+  gdcm::VR computeVR(gdcm::File const &file, gdcm::DataSet const &ds, const gdcm::Tag &tag) {
+    if (tag.IsPrivate()) // depends on the private creator in this data set
+      return gdcm::DataSetHelper::ComputeVR(file, ds, tag);
+    auto it = vrs.find(tag.GetElementTag());
+    if (it != vrs.end())
+      return it->second;
+    gdcm::VR vr = gdcm::DataSetHelper::ComputeVR(file, ds, tag);
+    vrs.insert(std::make_pair(tag.GetElementTag(), vr));
+    return vr;
   }
-  if (what == "PatientID" || what == "PATIENTID") {
-    if (isPrivateTag?ds.FindDataElement(phTag):ds.FindDataElement(hTag)) {
-      gdcm::DataElement de1 = ds.GetDataElement( hTag );
-      std::string val = limitToMaxLength(hTag, params->patientid, ds);
-      de1.SetByteValue( val.c_str(), (uint32_t)val.size() );
-      ds.Replace( de1 );
+};
+
+// if true it indicates that some work was done
+bool applyWork(const gdcm::DataElement &de,
+	       AnonContext &ctx,
+	       gdcm::DataSet &ds,
+	       const Rule &rule) {
+  threadparams *params = ctx.params;
+  gdcm::StringFilter &sf = ctx.sf;
+  const std::string &trueStudyInstanceUID = ctx.trueStudyInstanceUID;
+  const std::string &filename = ctx.filename;
+
+  const gdcm::Tag &hTag = rule.tag; // either hTag or phTag
+  const gdcm::PrivateTag &phTag = rule.privateTag;
+  const bool isPrivateTag = rule.isPrivate;
+  const std::string &which = rule.which;
+  const std::string &what = rule.what;
+  const int a = hTag.GetGroup();
+  const int b = hTag.GetElement();
+  // the element might be a private tag of a different owner
+  auto findElement = [&]() { return isPrivateTag ? ds.FindDataElement(phTag) : ds.FindDataElement(hTag); };
+
+  switch (rule.action) {
+  case ACTION_SKIP:
+    return false; // already handeled above, nothing is done
+
+  case ACTION_REGEXP:
+    // as a test print out what we got
+    if (findElement()) {
+
+      std::string scratch;
+      std::string_view value = ctx.textValue(ds, de, scratch);
+      std::string val(value); // std::smatch needs a std::string
+      std::string ns("");
+      bool failed = !rule.re; // not a valid regular expression, the value is set to empty
+      if (rule.re) {
+        try {
+          std::smatch match;
+          if (std::regex_search(val, match, *rule.re) && match.size() > 1) {
+            for (int j = 1; j < match.size(); j++) {
+              ns += match.str(j) + std::string(" ");
+            }
+          } else {
+            ns = std::string("FIONA: no match on regular expression");
+          }
+        } catch (std::regex_error &e) {
+          failed = true;
+        }
+      }
+      if (failed && debug_level > 0)
+        fprintf(stderr, "ERROR: regular expression match failed on %04x,%04x which: %s what: %s old: %s new: %s\n", a, b, which.c_str(),
+          what.c_str(), val.c_str(), ns.c_str());
+      ns = limitToMaxLength(de, ns);
+      setValue(de, ns.c_str(), (uint32_t)ns.size());
+    }
+    return true;
+
+  case ACTION_REPLACE:
+    // BlockOwner, ProjectName, PatientID, EventName, SiteName, replace
+    if (findElement()) {
+      std::string val = limitToMaxLength(de, rule.value);
+      setValue(de, val.c_str(), (uint32_t)val.size());
       return true;
     }
     return false;
-  }
-  if (what == "EventName" || what == "EVENTNAME") {
-    if (isPrivateTag?ds.FindDataElement(phTag):ds.FindDataElement(hTag)) {
-      gdcm::DataElement de1 = ds.GetDataElement( hTag );
-      std::string val = limitToMaxLength(hTag, params->eventname, ds);
-      de1.SetByteValue( val.c_str(), (uint32_t)val.size() );
-      ds.Replace( de1 );
+
+  case ACTION_SET:
+    // empty, YES, MODIFIED
+    if (findElement()) {
+      setValue(de, rule.value.c_str(), (uint32_t)rule.value.size());
       return true;
     }
     return false;
-  }
-  if (which == "BodyPartExamined" && what == "BODYPART") {
+
+  case ACTION_BODYPART: {
     // allow all allowedBodyParts, or set to BODYPART
-    if (isPrivateTag?ds.FindDataElement(phTag):ds.FindDataElement(hTag)) {
-      //        if (ds.FindDataElement(hTag)) {
-      std::string input_bodypart = sf.ToString(hTag);
+    if (findElement()) {
+      std::string scratch;
+      std::string_view input_bodypart = ctx.textValue(ds, de, scratch);
       bool found = false;
       for (int b_idx = 0; b_idx < allowedBodyParts.size(); b_idx++) {
         // what is the current value in this tag?
         // could we have a space at the end of input_bodypart?
-        std::string allowedBP = allowedBodyParts[b_idx][3];
-        if (allowedBP.size() % 2 == 1) { // we need even length strings for comparisson
-          allowedBP += " ";
-        }
-        // fprintf(stdout, "body parts: \"%s\" \"%s\"\n", input_bodypart.c_str(), allowedBP.c_str());
-        if (input_bodypart.compare(allowedBP) == 0) {
+        const std::string &allowedBP = allowedBodyParts[b_idx][3].get_ref<const std::string &>();
+        // we need even length strings for comparisson
+        bool padded = allowedBP.size() % 2 == 1;
+        if (input_bodypart.size() == allowedBP.size() + padded && input_bodypart.compare(0, allowedBP.size(), allowedBP) == 0 &&
+            (!padded || input_bodypart.back() == ' ')) {
           // allowed string, keep it
           found = true;
           break;
@@ -1254,46 +1568,23 @@ bool applyWork(gdcm::DataElement de,
     if (debug_level > 2) {
       fprintf(stdout, "unknown body part, replace with BODYPART\n"); 
     }
-    gdcm::DataElement de1 = ds.GetDataElement( hTag );
     std::string val("BODYPART");
-    de1.SetByteValue( val.c_str(), (uint32_t)val.size() );
-    ds.Replace( de1 );
+    setValue(de, val.c_str(), (uint32_t)val.size());
     // if we do not find it we need to do something? 
     return true;
   }
-  
-  if (what == "replace") {
-    if (isPrivateTag?ds.FindDataElement(phTag):ds.FindDataElement(hTag)) {
-      gdcm::DataElement de1 = ds.GetDataElement( hTag );
-      std::string val = limitToMaxLength(hTag, which, ds);
-      de1.SetByteValue( val.c_str(), (uint32_t)val.size() );
-      ds.Replace( de1 );
-      return true;
-    }
-    return false;
-  }
-  if (what == "remove") {
-    if (hTag.IsPrivate()) {
-      gdcm::PrivateTag phTag = gdcm::PrivateTag(a,b,which.c_str()); // this will only work if the 0010 entry string in which is correct
+
+  case ACTION_REMOVE:
+    if (isPrivateTag) {
+      // this will only work if the 0010 entry string in which is correct
       const gdcm::DataElement &ddee = ds.GetDataElement(phTag);
       return ds.Remove( ddee.GetTag() ) == 1;
     }
     return false;
-  }
-  if (what == "empty") {
-    if (isPrivateTag?ds.FindDataElement(phTag):ds.FindDataElement(hTag)) {
-      gdcm::DataElement de1 = ds.GetDataElement( hTag );
-      std::string val("");
-      de1.SetByteValue( val.c_str(), (uint32_t)val.size() );
-      ds.Replace( de1 );
-      return true;
-    }
-    return false;
-  }
-  if (what == "hashuid+PROJECTNAME") {
-    if (isPrivateTag?ds.FindDataElement(phTag):ds.FindDataElement(hTag)) {
-      gdcm::DataElement de1 = ds.GetDataElement( hTag );
-      const gdcm::ByteValue *bv4 = de1.GetByteValue();
+
+  case ACTION_HASHUID_PROJECT:
+    if (findElement()) {
+      const gdcm::ByteValue *bv4 = de.GetByteValue();
       
       std::string val("");
       if (bv4) {
@@ -1303,24 +1594,21 @@ bool applyWork(gdcm::DataElement de,
       }
       // std::string val = sf.ToString(hTag); // this is problematic - we get the first occurance of this tag, not nessessarily the root tag
       //std::string hash = SHA256::digestString(val + params->projectname).toHex();
-      std::string hash = betterUID(val + params->projectname, params->old_style_uid);
-      if (which == "SOPInstanceUID") // keep a copy as the filename for the output
-        filenamestring = hash.c_str();
-      
-      if (which == "SeriesInstanceUID")
-        seriesdirname = hash.c_str();
+      UIDBuffer buf;
+      std::string_view hash = ctx.hashedUID(true, val + params->projectname, params->old_style_uid, buf, rule.memoize);
+      // the output file name and series directory are taken from the root before (readOutputNames)
       
-      if (which == "StudyInstanceUID") {
+      if (rule.target == TARGET_STUDYINSTANCEUID) {
         // fprintf(stdout, "%s %s ?= %s\n", filename, val.c_str(), trueStudyInstanceUID.c_str());
         if (trueStudyInstanceUID != val) { // in rare cases we will not get the correct tag from sf.ToString, instead use the explicit loop over the root tags
           val = trueStudyInstanceUID;
           // hash = SHA256::digestString(val + params->projectname).toHex();
-          hash = betterUID(val + params->projectname, params->old_style_uid);
+          hash = ctx.hashedUID(true, val + params->projectname, params->old_style_uid, buf);
         }
         // we want to keep a mapping of the old and new study instance uids
-        params->byThreadStudyInstanceUID.insert(std::pair<std::string, std::string>(val, hash)); // should only add this pair once
+        params->studyMapping->insert(val, std::string(hash)); // should only add this pair once
       }
-      if (which == "SeriesInstanceUID") {
+      if (rule.target == TARGET_SERIESINSTANCEUID) {
         // we want to keep a mapping of the old and new study instance uids
         std::string key(val);
         std::string value(hash);
@@ -1332,29 +1620,28 @@ bool applyWork(gdcm::DataElement de,
           std::string::iterator it = value.end() -1;
           value.erase(it);
         }
-        params->byThreadSeriesInstanceUID.insert(std::pair<std::string, std::string>(key, value)); // should only add this pair once
+        params->seriesMapping->insert(key, value); // should only add this pair once
       }
       
       //if (ds.FindDataElement(gdcm::Tag(a, b)))
-      hash = limitToMaxLength(hTag, hash, ds);
+      hash = limitToMaxLength(de, hash);
       // SetByteValue will complain if we try to add an odd length hash
       // but if we write a UID with a space we will get complains later if we want to read them... hmm..
       //if (hash.size()%2!=0)
       //  hash += " ";
       
-      de1.SetByteValue( hash.c_str(), (uint32_t)hash.size() );
-      ds.Replace( de1 );
+      setValue(de, hash.data(), (uint32_t)hash.size());
       
-      // anon.Replace(hTag, limitToMaxLength(hTag, hash, ds).c_str());
+      // anon.Replace(hTag, limitToMaxLength(de, hash).c_str());
       // this does not replace elements inside sequences
       return true;
     }
     return false;
-  }
-  if (what == "hashuid" || what == "hash") {
-    if (isPrivateTag?ds.FindDataElement(phTag):ds.FindDataElement(hTag)) {
-      gdcm::DataElement de1 = ds.GetDataElement( hTag );
-      const gdcm::ByteValue *bv4 = de1.GetByteValue();
+
+  case ACTION_HASHUID:
+  case ACTION_HASH:
+    if (findElement()) {
+      const gdcm::ByteValue *bv4 = de.GetByteValue();
       std::string val("");
       if (bv4) {
         val = std::string(bv4->GetPointer(), bv4->GetLength() );
@@ -1368,28 +1655,17 @@ bool applyWork(gdcm::DataElement de,
       // case the PACS might assume that the request id is the same, but the patient info does not match resulting
       // in a mismatch error.
       // For now we replace the StudyID with the hash of the StudyInstanceUID - ALWAYS.
-      if (which == "StudyID") {
+      if (rule.target == TARGET_STUDYID) {
         // if this is the case replace the StudyID with the hash from the StudyInstanceUID
         val = trueStudyInstanceUID + params->projectname;
         // val = trueStudyInstanceUID;
         //fprintf(stderr, "WARNING: OUR StudyID tag was empty, now it is: \"%s\"\n", val.c_str());
       }
       
-      std::string hash = "";
-      if (params->old_style_uid) {
-        hash = SHA256::digestString(val).toHex();
-      } else {
-        SHA256::digest a = SHA256::digestString(val);
-        hash = toDec(a.data, a.size);            
-      }
-      
-      if (which == "SOPInstanceUID") // keep a copy as the filename for the output
-        filenamestring = hash.c_str();
-      
-      if (which == "SeriesInstanceUID")
-        seriesdirname = hash.c_str();
+      UIDBuffer buf;
+      std::string_view hash = ctx.hashedUID(false, val, params->old_style_uid, buf, rule.memoize);
       
-      if (which == "SeriesInstanceUID") {
+      if (rule.target == TARGET_SERIESINSTANCEUID) {
         // we want to keep a mapping of the old and new study instance uids
         std::string key(val);
         std::string value(hash);
@@ -1401,42 +1677,34 @@ bool applyWork(gdcm::DataElement de,
           std::string::iterator it = value.end() -1;
           value.erase(it);
         }
-        params->byThreadSeriesInstanceUID.insert(std::pair<std::string, std::string>(key, value)); // should only add this pair once
+        params->seriesMapping->insert(key, value); // should only add this pair once
       }
       
-      if (which == "StudyInstanceUID") {
+      if (rule.target == TARGET_STUDYINSTANCEUID) {
         if (trueStudyInstanceUID != val) { // in rare cases we will not get the correct tag from sf.ToString, instead use the explicit loop over the root tags
           // fprintf(stdout, "True StudyInstanceUID is not the same as ToString one: %s != %s\n", val.c_str(), trueStudyInstanceUID.c_str());
           val = trueStudyInstanceUID;
-          if (what == "hashuid") { // with root
-            hash = betterUID(val);
+          if (rule.action == ACTION_HASHUID) { // with root
+            hash = ctx.hashedUID(true, val, false, buf);
           } else { // if we can use the hash instead, no root infront
-            if (params->old_style_uid) {
-              hash = SHA256::digestString(val).toHex();
-            } else {
-              SHA256::digest a = SHA256::digestString(val);
-              hash = toDec(a.data, a.size);
-            }
+            hash = ctx.hashedUID(false, val, params->old_style_uid, buf);
           }
         }
       }
       
-      hash = limitToMaxLength(hTag, hash, ds);
-      de1.SetByteValue( hash.c_str(), (uint32_t)hash.size() );
-      ds.Replace( de1 );
+      hash = limitToMaxLength(de, hash);
+      setValue(de, hash.data(), (uint32_t)hash.size());
       return true;
     }
     return false;
-  }
-  if (what == "keep") {
+
+  case ACTION_KEEP:
     // so we do nothing...
     return false;
-  }
-  if (what == "incrementdate") {
-    if (isPrivateTag?ds.FindDataElement(phTag):ds.FindDataElement(hTag)) {
-      int nd = params->dateincrement;
-      gdcm::DataElement de1 = ds.GetDataElement( hTag );
-      const gdcm::ByteValue *bv4 = de1.GetByteValue();
+
+  case ACTION_INCREMENTDATE:
+    if (findElement()) {
+      const gdcm::ByteValue *bv4 = de.GetByteValue();
       
       std::string val("");
       if (bv4) {
@@ -1446,22 +1714,13 @@ bool applyWork(gdcm::DataElement de,
         val = sf.ToString(hTag); // does not seem to work inside a sequence, but is this really needed?
       }
       
-      // parse the date string YYYYMMDD
-      struct sdate date1;
-      if (sscanf(val.c_str(), "%04ld%02ld%02ld", &date1.y, &date1.m, &date1.d) == 3) {
-        // replace with added value
-        addDays(date1, nd);
-        //long c = gday(date1) + nd;
-        //struct sdate date2 = dtf(c);
-        char dat[256];
-        snprintf(dat, 256, "%04ld%02ld%02ld", date1.y, date1.m, date1.d);
+      // parse the date string YYYYMMDD and replace with added value
+      bool parsed;
+      std::string_view dat = ctx.dates.shiftDate(val, parsed);
+      if (parsed) {
         //fprintf(stdout, "found a date (%04x,%04x): %s, replace with date: %s\n", a, b, val.c_str(), dat);
-        // fprintf(stdout, "found a date : %s, replace with date: %s\n",
-        // val.c_str(), dat);
-        
-        de1.SetByteValue( dat, (uint32_t)strlen(dat) );
-        ds.Replace( de1 );
-        //anon.Replace(hTag, limitToMaxLength(hTag, std::string(dat), ds).c_str());
+        setValue(de, dat.data(), (uint32_t)dat.size());
+        //anon.Replace(hTag, limitToMaxLength(de, std::string(dat)).c_str());
       } else {
         // could not read the date here, just remove instead
         // fprintf(stdout, "Warning: could not parse a date (\"%s\", %04o,
@@ -1479,40 +1738,24 @@ bool applyWork(gdcm::DataElement de,
           char dat[256];
           snprintf(dat, 256, "%s%02d%02d", fixed_year.c_str(), variable_month, day);
           // fprintf(stderr, "Warning: no date could be parsed in \"%s\" so there is no shifted date, use random date instead.\n", val.c_str());
-          de1.SetByteValue( dat, (uint32_t)strlen(dat) );
-          ds.Replace( de1 );
+          setValue(de, dat, (uint32_t)strlen(dat));
         } else {
           // keep them empty
           char dat[1] = {'\0'};
-          de1.SetByteValue( dat, (uint32_t)strlen(dat) );
-          ds.Replace( de1 );
+          setValue(de, dat, (uint32_t)strlen(dat));
         }
         //anon.Replace(hTag, dat);
       }
       return true;
     }
     return false;
-  }
-  if (what == "incrementdatetime") {
+
+  case ACTION_INCREMENTDATETIME:
     //fprintf(stderr, "FOUND an increemntdatetime field\n");fflush(stderr);
-    if (isPrivateTag?ds.FindDataElement(phTag):ds.FindDataElement(hTag)) {
+    if (findElement()) {
       //fprintf(stderr, "inside find data element\n");
-      int nd = params->dateincrement;
-      gdcm::DataElement de1 = ds.GetDataElement( hTag );
-      const gdcm::ByteValue *bv4 = de1.GetByteValue();
+      const gdcm::ByteValue *bv4 = de.GetByteValue();
       
-      //if ( de1.IsEmpty() ) {
-      //  fprintf(stdout, "de1 is empty\n");
-      //}
-      
-      /*if ( de1.GetVL() ) {
-	fprintf(stdout, "got a value length\n");
-	const gdcm::Value& v = de1.GetValue();
-	const gdcm::ByteValue &bv = dynamic_cast<const gdcm::ByteValue&>(v);
-	gdcm::Element<gdcm::VR::DT,1> e;
-	const void *array = bv.GetVoidPointer();
-	//memcpy( (void*)(&e), array, e.GetLength() * sizeof( gdcm::VRToType<gdcm::VR::DT>::Type) );
-	}*/
       std::string val("");
       if (bv4) {
         val = std::string(bv4->GetPointer(), bv4->GetLength() );
@@ -1522,66 +1765,14 @@ bool applyWork(gdcm::DataElement de,
       }
       
       //std::string val = sf.ToString(hTag); // does not seem to work inside a sequence
-      // parse the date string YYYYMMDDHHMMSS
-      struct sdate date1;
-      char t[245];
-      // based on the standard components of DT can be empty (null components), but we already have a YYYY
-      int numParsedDateObjects = sscanf(val.c_str(), "%04ld%02ld%02ld%s", &date1.y, &date1.m, &date1.d, t);
-      if (numParsedDateObjects == 4) {
-	
-        // try this with chrono instead
-        addDays(date1, nd);
-        
-        //long c = gday(date1) + nd;
-        //struct sdate date2 = dtf(c);
-        char dat[256];
-        // TODO: ok, there are valid DT fields that only contain a year or only a year and a month but no day
-        snprintf(dat, 256, "%04ld%02ld%02ld%s%s", date1.y, date1.m, date1.d, t, (((strlen(t)%2)==0)?"":" "));
-        //fprintf(stdout, "found a date (%04x,%04x): %s, replace with date: %s\n", a, b, val.c_str(), dat);
-        de1.SetByteValue( dat, (uint32_t)strlen(dat) );
-        ds.Replace( de1 );
-	
-      } else if ( numParsedDateObjects == 3) { // assume that t is empty
-        addDays(date1, nd);
-	
-        // replace with added value
-        // long c = gday(date1) + nd;
-        //struct sdate date2 = dtf(c);
-        char dat[256];
-        // TODO: ok, there are valid DT fields that only contain a year or only a year and a month but no day
-        snprintf(dat, 256, "%04ld%02ld%02ld", date1.y, date1.m, date1.d);
+      // parse the date string YYYYMMDDHHMMSS, based on the standard components of DT can be
+      // empty (null components), YYYY, YYYYMM and YYYYMMDD are shifted as well
+      bool parsed;
+      std::string_view dat = ctx.dates.shiftDateTime(val, parsed);
+      if (parsed) {
         if (debug_level > 2)
-          fprintf(stdout, "found a date (%04x,%04x): %s, replace with date: %s\n", a, b, val.c_str(), dat);
-        de1.SetByteValue( dat, (uint32_t)strlen(dat) );
-        ds.Replace( de1 );
-            } else if ( numParsedDateObjects == 2) { // assume that t is empty
-        // replace with added value
-        date1.d = 1;
-        addDays(date1, nd);
-        
-        //long c = gday(date1) + nd;
-        //struct sdate date2 = dtf(c);
-        char dat[256];
-        // TODO: ok, there are valid DT fields that only contain a year or only a year and a month but no day
-        snprintf(dat, 256, "%04ld%02ld", date1.y, date1.m);
-        if (debug_level > 2)
-          fprintf(stdout, "found a date (%04x,%04x): %s, replace with date: %s\n", a, b, val.c_str(), dat);
-        de1.SetByteValue( dat, (uint32_t)strlen(dat) );
-        ds.Replace( de1 );
-            } else if ( numParsedDateObjects == 1) { // assume that t is empty
-        // replace with added value
-        date1.d = 1;
-        date1.m = 1;
-        addDays(date1, nd);
-        //long c = gday(date1) + nd;
-        //struct sdate date2 = dtf(c);
-        char dat[256];
-        // TODO: ok, there are valid DT fields that only contain a year or only a year and a month but no day
-        snprintf(dat, 256, "%04ld", date1.y);
-        if (debug_level > 2)
-          fprintf(stdout, "found a date (%04x,%04x): %s, replace with date: %s\n", a, b, val.c_str(), dat);
-        de1.SetByteValue( dat, (uint32_t)strlen(dat) );
-        ds.Replace( de1 );
+          fprintf(stdout, "found a date (%04x,%04x): %s, replace with date: %.*s\n", a, b, val.c_str(), (int)dat.size(), dat.data());
+        setValue(de, dat.data(), (uint32_t)dat.size());
       } else {
         // could not read the date here, just remove instead
         if (debug_level > 2)
@@ -1590,97 +1781,38 @@ bool applyWork(gdcm::DataElement de,
         // TODO: We should try harder here. The day and month might be missing components
         // and we still have a DT field that is valid (null components).
         char dat[1] = {'\0'};
-        de1.SetByteValue( dat, (uint32_t)strlen(dat) );
-        ds.Replace( de1 );
+        setValue(de, dat, (uint32_t)strlen(dat));
         // anon.Replace(hTag, "");
       }
       return true;
     }
     return false;
-  }
-  if (what == "YES") {
-    if (isPrivateTag?ds.FindDataElement(phTag):ds.FindDataElement(hTag)) {
-      gdcm::DataElement de1 = ds.GetDataElement( hTag );
-      const gdcm::ByteValue *bv4 = de1.GetByteValue();
-      /*std::string val("");
-      if (bv4) {
-      val = std::string(bv4->GetPointer(), bv4->GetLength() );
-      } else {
-      val = sf.ToString(hTag); // does not seem to work inside a sequence, but is this really needed?
-      }*/
-      char dat[5];
-      snprintf(dat, 5, "YES ");
-      de1.SetByteValue( dat, (uint32_t)strlen(dat) );
-      ds.Replace( de1 );
-      return true;
-    }
-    return false;
-  }
-  if (what == "MODIFIED") {
-    if (isPrivateTag?ds.FindDataElement(phTag):ds.FindDataElement(hTag)) {
-      gdcm::DataElement de1 = ds.GetDataElement( hTag );
-      const gdcm::ByteValue *bv4 = de1.GetByteValue();
-      /*std::string val("");
-      if (bv4) {
-      val = std::string(bv4->GetPointer(), bv4->GetLength() );
-      } else {
-      val = sf.ToString(hTag); // does not seem to work inside a sequence, but is this really needed?
-      }*/
-      char dat[9];
-      snprintf(dat, 9, "MODIFIED");
-      de1.SetByteValue( dat, (uint32_t)strlen(dat) );
-      ds.Replace( de1 );
-      return true;
-    }
-    return false;
-  }
-  if (what == "PROJECTNAME") {
-    if (isPrivateTag?ds.FindDataElement(phTag):ds.FindDataElement(hTag)) {
-      gdcm::DataElement de1 = ds.GetDataElement( hTag );
-      std::string val = limitToMaxLength(hTag, params->projectname, ds);
-      de1.SetByteValue( val.c_str(), (uint32_t)val.size() );
-      ds.Replace( de1 );
-      return true;
-    }
-    return false;
-  }
-  if (what == "SITENAME") {
-    if (isPrivateTag?ds.FindDataElement(phTag):ds.FindDataElement(hTag)) {
-      gdcm::DataElement de1 = ds.GetDataElement( hTag );
-      std::string val = limitToMaxLength(hTag, params->sitename, ds);
-      de1.SetByteValue( val.c_str(), (uint32_t)val.size() );
-      ds.Replace( de1 );
+
+  case ACTION_REPLACE_EVEN:
+    // Some entries have Re-Mapped, that could be a name on the command line or,
+    // by default we should hash the id
+    // fallback, if everything fails we just use the which and set that's field value
+    if (findElement()) {
+      std::string val = limitToMaxLength(de, rule.value);
+      if ( val.size()%2 != 0 )
+        val += " ";
+      setValue(de, val.c_str(), (uint32_t)val.size());
       return true;
     }
     return false;
   }
-  // Some entries have Re-Mapped, that could be a name on the command line or,
-  // by default we should hash the id
-  // fprintf(stdout, "Warning: set to what: %s %s which: %s what: %s\n", tag1.c_str(), tag2.c_str(), which.c_str(), what.c_str());
-  // fallback, if everything fails we just use the which and set that's field value
-  if (isPrivateTag?ds.FindDataElement(phTag):ds.FindDataElement(hTag)) {
-    gdcm::DataElement de1 = ds.GetDataElement( hTag );
-    std::string val = limitToMaxLength(hTag, what, ds);
-    if ( val.size()%2 != 0 )
-      val += " ";
-    de1.SetByteValue( val.c_str(), (uint32_t)val.size() );
-    ds.Replace( de1 );
-    return true;
-  }
   return false;
 }
 
 // new attempt to anonymize - including sequences
 // example is from gdcmAnonymizer.cxx:
 //   static bool Anonymizer_RemoveRetired(File const &file, DataSet &ds)
-static bool AnonymizeBasedOnWork(gdcm::File const &file, gdcm::DataSet &ds, const std::string trueStudyInstanceUID, threadparams *params, std::string &filenamestring, std::string &seriesdirname, int level) {
+static bool AnonymizeBasedOnWork(gdcm::File const &file, gdcm::DataSet &ds, AnonContext &ctx, int level) {
   //static const gdcm::Global &g = gdcm::GlobalInstance;
   //static const gdcm::Dicts &dicts = g.GetDicts();
   //static const gdcm::Dict &pubdict = dicts.GetPublicDict();
 
   std::string spaces(level, ' ');
-  char buf1[16];
-  char buf2[16];
 
   gdcm::DataSet::Iterator it = ds.Begin();
   for ( ; it != ds.End(); ) {
@@ -1689,7 +1821,7 @@ static bool AnonymizeBasedOnWork(gdcm::File const &file, gdcm::DataSet &ds, cons
     // std::set::erase invalidate iterator, so we need to make a copy first:
     gdcm::DataSet::Iterator dup = it;
     if (debug_level > 2)
-      fprintf(stdout, "%s  0x%04x,0x%04x advance in %zu, %s level: %d\n", spaces.c_str(), ttt.GetGroup(), ttt.GetElement(), ds.Size(), filenamestring.c_str(), level); fflush(stdout);
+      fprintf(stdout, "%s  0x%04x,0x%04x advance in %zu, %s level: %d\n", spaces.c_str(), ttt.GetGroup(), ttt.GetElement(), ds.Size(), ctx.filenamestring.c_str(), level); fflush(stdout);
     ++it;
 
     const gdcm::DataElement &de = *dup;
@@ -1698,7 +1830,7 @@ static bool AnonymizeBasedOnWork(gdcm::File const &file, gdcm::DataSet &ds, cons
       fprintf(stdout, "%s  %04x,%04x data element\n", spaces.c_str(), tt.GetGroup(), tt.GetElement());fflush(stdout);
     }
     
-    gdcm::VR vr = gdcm::DataSetHelper::ComputeVR(file, ds, de.GetTag() );
+    gdcm::VR vr = ctx.computeVR(file, ds, de.GetTag() );
     if ( vr.Compatible(gdcm::VR::SQ) ) {
       gdcm::SmartPointer<gdcm::SequenceOfItems> sq = de.GetValueAsSQ();
       if ( sq ) {
@@ -1706,7 +1838,7 @@ static bool AnonymizeBasedOnWork(gdcm::File const &file, gdcm::DataSet &ds, cons
         for ( gdcm::SequenceOfItems::SizeType i = 1; i <= n; i++) { // items start counting at 1
           gdcm::Item &item = sq->GetItem( i );
           gdcm::DataSet &nested = item.GetNestedDataSet();
-          AnonymizeBasedOnWork( file, nested, trueStudyInstanceUID, params, filenamestring, seriesdirname, level+4 );
+          AnonymizeBasedOnWork( file, nested, ctx, level+4 );
         }
         gdcm::DataElement de_dup = *dup;
         de_dup.SetValue( *sq );
@@ -1715,22 +1847,12 @@ static bool AnonymizeBasedOnWork(gdcm::File const &file, gdcm::DataSet &ds, cons
       }
     } else {
       // not a sequence, so anonymize this data element
-      const std::string filename("unknown, inside sequence");
-      // we need an anon 
-      gdcm::Anonymizer anon;
-      anon.SetFile(file);
-      
-      // We would like to replace this loop. Should be a lookup only
-      int a = tt.GetGroup();
-      int b = tt.GetElement();
-      snprintf(buf1, 16, "%04x", a);
-      snprintf(buf2, 16, "%04x", b);
-      std::string key = std::string(buf1) + std::string(buf2);
-      if (workCache.find(key) != workCache.end()) {
-        // found an entry for this group/element in the cache, extract index work[wi]
-        int wi = workCache.find(key)->second;
+      // lookup of the rule for this group/element
+      int wi = workCache.find(tt.GetElementTag());
+      if (wi >= 0) {
+        // found an entry for this group/element in the cache, extract index rules[wi]
         // we want to anonymize the current DataElement de, not all of them
-        bool somethingDone = applyWork(de, anon, ds, wi, params, trueStudyInstanceUID, filename, filenamestring, seriesdirname);
+        bool somethingDone = applyWork(de, ctx, ds, rules[wi]);
         if (debug_level > 2 && somethingDone) {
           fprintf(stdout, "%s   did something on tag %04x,%04x\n", spaces.c_str(), tt.GetGroup(), tt.GetElement());
         }
@@ -1776,20 +1898,188 @@ static bool AnonymizeBasedOnWork(gdcm::File const &file, gdcm::DataSet &ds, cons
     return sf->ToString(t);
 }*/
 
+// Read a DICOM file. With splice set the file is read only up to the PixelData element. If the
+// PixelData element is the last element of the file its byte range is returned in pixelStart and
+// pixelEnd, spliced is set and the pixel data stays on disk. Otherwise (no pixel data, elements
+// after the pixel data, deflated or big endian transfer syntax) the file is read completely.
+// If input is set the file is parsed from that stream (memory mapping or prefetched content)
+// instead of being opened by gdcm.
+static bool readFile(gdcm::Reader &reader, const char *filename, std::istream *input, bool splice, uintmax_t &pixelStart, uintmax_t &pixelEnd,
+                     bool &spliced) {
+  spliced = false;
+  if (input)
+    reader.SetStream(*input);
+  else
+    reader.SetFileName(filename);
+  if (!splice)
+    return reader.Read();
+
+  const gdcm::Tag pixelData(0x7fe0, 0x0010);
+  std::set<gdcm::Tag> skiptags;
+  skiptags.insert(pixelData);
+  if (reader.ReadUpToTag(pixelData, skiptags)) {
+    const gdcm::TransferSyntax &ts = reader.GetFile().GetHeader().GetDataSetTransferSyntax();
+    if (ts.IsValid() && !ts.IsEncoded() && ts != gdcm::TransferSyntax::ExplicitVRBigEndian) {
+      int fd = open(filename, O_RDONLY);
+      if (fd >= 0) {
+        struct stat st;
+        if (fstat(fd, &st) == 0 && pixelDataExtent(fd, reader.GetStreamCurrentPosition(), ts.IsImplicit(), pixelStart, pixelEnd) &&
+            pixelEnd == (uintmax_t)st.st_size)
+          spliced = true;
+        close(fd);
+      }
+    }
+    if (spliced)
+      return true;
+  }
+  if (debug_level > 1)
+    fprintf(stdout, "cannot copy the pixel data of \"%s\" unchanged, read the whole file\n", filename);
+  // start again with an empty file
+  gdcm::SmartPointer<gdcm::File> file = new gdcm::File;
+  reader.SetFile(*file);
+  if (input) { // from the start again
+    input->clear();
+    input->seekg(0);
+    reader.SetStream(*input);
+  } else
+    reader.SetFileName(filename);
+  return reader.Read();
+}
+
+// copy the pixel data element of the input file to the end of the (already written) output file
+static bool appendPixelData(const char *filename, uintmax_t pixelStart, uintmax_t pixelEnd, const std::string &outfilename) {
+  int in = open(filename, O_RDONLY);
+  if (in < 0)
+    return false;
+  int out = open(outfilename.c_str(), O_WRONLY);
+  if (out < 0) {
+    close(in);
+    return false;
+  }
+  bool ok = appendFileRange(in, pixelStart, pixelEnd - pixelStart, out);
+  ok = (close(out) == 0) && ok;
+  close(in);
+  return ok;
+}
+
+// Get the next file for this thread. In streaming mode the file name is copied out of the
+// queue into streamed, otherwise the scheduler picks an entry of the file list. Without wait
+// the queue is not waited on if it is empty right now.
+static const char *nextFile(threadparams *params, std::string &streamed, size_t &file, bool wait = true) {
+  if (params->queue) {
+    if (!(wait ? params->queue->pop(streamed, file) : params->queue->tryPop(streamed, file)))
+      return NULL;
+    return streamed.c_str();
+  }
+  if (!params->scheduler->next(params->thread, file))
+    return NULL;
+  return params->filenames[file];
+}
+
+// a file claimed by a thread, with the stat of the input file if the journal looked at it
+struct ClaimedFile {
+  std::string name;
+  size_t index = 0;
+  struct stat st;
+  bool statted = false;
+};
+
+// Like nextFile but with asynchronous I/O up to asyncdepth files after the current one are
+// claimed by this thread and read in the background, they are processed in that order.
+// Files that are done according to the journal (--resume, --incremental) are skipped here,
+// before anything is read.
+static bool nextFileAhead(threadparams *params, AsyncFileIO *aio, std::deque<ClaimedFile> &ahead, ClaimedFile &next) {
+  const size_t depth = aio ? params->io.asyncdepth : 0;
+  std::string streamed;
+  size_t idx;
+  const char *name;
+  ClaimedFile claimed;
+  while (ahead.size() <= depth && (name = nextFile(params, streamed, idx, ahead.empty())) != NULL) {
+    if (params->journal && params->journal->done(name, claimed.st, claimed.statted)) {
+      if (debug_level > 1)
+        fprintf(stdout, "[%d] skip \"%s\", done in an earlier run\n", params->thread, name);
+      continue;
+    }
+    claimed.name = name;
+    claimed.index = idx;
+    ahead.push_back(claimed);
+    if (aio)
+      aio->prefetch(ahead.back().name);
+  }
+  if (ahead.empty())
+    return false;
+  next = std::move(ahead.front());
+  ahead.pop_front();
+  return true;
+}
+
+// Announce the files this thread will process next to the kernel so they are read into the
+// page cache while we work on the current file. Files of the journal are left out, they are
+// most likely skipped (a rerun over unchanged folders reads nothing ahead).
+static void readAheadNext(threadparams *params, ReadAhead &readahead) {
+  std::vector<std::string> names;
+  std::vector<size_t> indices;
+  std::vector<const char *> upcoming;
+  if (params->queue) {
+    params->queue->peek(readahead.numFiles(), names);
+    for (const std::string &name : names)
+      upcoming.push_back(name.c_str());
+  } else {
+    params->scheduler->peek(params->thread, readahead.numFiles(), indices);
+    for (size_t idx : indices)
+      upcoming.push_back(params->filenames[idx]);
+  }
+  if (params->journal)
+    upcoming.erase(std::remove_if(upcoming.begin(), upcoming.end(), [params](const char *name) { return params->journal->listed(name); }),
+                   upcoming.end());
+  readahead.update(upcoming);
+}
+
 void *ReadFilesThread(void *voidparams) {
   threadparams *params = static_cast<threadparams *>(voidparams);
   gdcm::Global gl;
   
   const size_t nfiles = params->nfiles;
-  for (unsigned int file = 0; file < nfiles; ++file) {
-    const char *filename = params->filenames[file];
+  size_t file;
+  std::string current;
+  // the helpers used to anonymize a file are created once for this thread
+  AnonContext ctx(params);
+  MappedInput mapped; // the current input file if --mmap is used
+  std::unique_ptr<Journal::Buffer> journal; // lines of this thread, before the committer that adds to it
+  if (params->journal)
+    journal.reset(new Journal::Buffer(*params->journal));
+  OutputCommitter committer(params->io.durability, params->outputdir, params->thread); // before aio, background writes commit through it
+  AsyncFileIO aio(params->io.asyncdepth);
+  params->async = aio.start();
+  std::deque<ClaimedFile> ahead; // files claimed and prefetched but not processed yet
+  ClaimedFile claimed;           // the current file
+  std::vector<char> prefetched;                     // content of the current file if it was read in the background
+  MemoryInput memory;
+  ReadAhead readahead(params->io.prefetchfiles, params->io.prefetchwindow);
+  while (nextFileAhead(params, params->async ? &aio : NULL, ahead, claimed)) {
+    committer.poll(); // a group that is due is synced before this file, not after it
+    current = std::move(claimed.name);
+    file = claimed.index;
+    const char *filename = current.c_str();
+    if (params->io.prefetchfiles > 0)
+      readAheadNext(params, readahead);
+    struct stat &inputstat = claimed.st; // size and modification time for the journal, the journal may have it already
+    const bool journaled = journal && (claimed.statted || stat(filename, &inputstat) == 0);
     // std::cerr << filename << std::endl;
+    std::istream *input = NULL; // NULL: gdcm opens the file
+    if (params->async && aio.take(current, prefetched)) {
+      memory.reset(prefetched.data(), prefetched.size());
+      input = &memory.stream();
+    } else if (params->io.mmapinput && mapped.open(filename, params->io.hugepages)) {
+      input = &mapped.stream();
+    }
 
     // gdcm::ImageReader reader;
     gdcm::Reader reader;
-    reader.SetFileName(filename);
+    bool spliced = false; // the pixel data was not read, it is copied from the input file after the header is written
+    uintmax_t pixelStart = 0, pixelEnd = 0;
     try {
-      if (!reader.Read()) {
+      if (!readFile(reader, filename, input, params->io.splicepixels, pixelStart, pixelEnd, spliced)) {
         std::cerr << "Failed to read as DICOM: \"" << filename << "\" in thread " << params->thread << std::endl;
         continue; // try the next file
       }
@@ -1801,43 +2091,9 @@ void *ReadFilesThread(void *voidparams) {
     // process sequences as well
     // lets check if we can change the sequence that contains the ReferencedSOPInstanceUID inside the 0008,1115 sequence
 
-    gdcm::DataSet &dss = reader.GetFile().GetDataSet();
-    // some tags we need to get from the root element, otherwise we will have the case that
-    // we get a StudyInstanceUID inside the 0008,1200 region which is only the referenced UID
-    std::string trueStudyInstanceUID = "";
-    typedef std::set<gdcm::DataElement> DataElementSet;
-    typedef DataElementSet::const_iterator ConstIterator;
-    ConstIterator cit = dss.GetDES().begin();
-    for( ; cit != dss.GetDES().end(); ++cit) {
-      std::stringstream strm;
-      if (cit->GetTag() == gdcm::Tag(0x0020, 0x000d)) {
-        const gdcm::DataElement &de = (*cit);
-        (*cit).GetValue().Print(strm);
-        trueStudyInstanceUID = strm.str();
-        break;
-      }
-    }
-    // can we get the modality from the file? We would like to use it as a prefix to the individual DICOM files filename
-    /*std::string modalitystring = "";
-    cit = dss.GetDES().begin();
-    for( ; cit != dss.GetDES().end(); ++cit) {
-      std::stringstream strm;
-      if (cit->GetTag() == gdcm::Tag(0x0008, 0x0060)) {
-        const gdcm::DataElement &de = (*cit);
-        (*cit).GetValue().Print(strm);
-        modalitystring = strm.str();
-        modalitystring.erase(modalitystring.find_last_not_of(" \n\r\t")+1);
-        // trim(modalitystring);
-        break;
-      }
-      }*/
-
-    gdcm::Anonymizer anon;
     gdcm::File &fileToAnon = reader.GetFile();
-    anon.SetFile(fileToAnon);
-
-    gdcm::MediaStorage ms;
-    ms.SetFromFile(fileToAnon);
+    ctx.reset(fileToAnon, filename);
+    gdcm::Anonymizer &anon = ctx.anon;
     // this next fails if we are looking at
     // Breast Tomosynthesis Image Storage   1.2.840.10008.5.1.4.1.1.13.1.3    Breast Tomosynthesis Image IOD
     /*if (!gdcm::Defs::GetIODNameFromMediaStorage(ms)) {
@@ -1846,13 +2102,62 @@ void *ReadFilesThread(void *voidparams) {
       continue;
       }*/
     gdcm::DataSet &ds = fileToAnon.GetDataSet();
+    // StudyInstanceUID and Modality from the root, before the rules change them
+    ctx.readRoot(ds);
+    const std::string &modalitystring = ctx.modality;
+    ctx.readOutputNames(ds);
+    std::string &filenamestring = ctx.filenamestring;
+    std::string &seriesdirname = ctx.seriesdirname; // only used if byseries is true
+
+    // the output file name, from the hashed SOPInstanceUID of the root
+    std::string imageInstanceUID = filenamestring;
+    if (imageInstanceUID == "") {
+      if (debug_level > 0)
+        fprintf(stderr, "Warning: cannot read image instance uid from %s, create a new one.\n", filename);
+      gdcm::UIDGenerator gen;
+      imageInstanceUID = gen.Generate();
+      filenamestring = imageInstanceUID;
+    }
+    if (modalitystring != "") {
+      filenamestring = modalitystring + "." + filenamestring;
+    }
 
-    gdcm::StringFilter sf;
-    sf.SetFile(fileToAnon);
+    std::string fn = params->outputdir + "/" + filenamestring + ".dcm";
+    if (params->byseries) {
+      // use the series instance uid as a directory name
+      std::string dn = params->outputdir + "/" + seriesdirname;
+      // each directory is created once per run, the other files of the series skip the stat
+      params->outputdirs->findOrInsert(dn, [&dn](std::string &) {
+        if (mkdir(dn.c_str(), 0777) != 0 && errno != EEXIST) {
+          fprintf(stderr, "Error: could not create the directory \"%s\" (%s).\n", dn.c_str(), strerror(errno));
+          return false; // try again with the next file of this series
+        }
+        return true;
+      });
+      fn = params->outputdir + "/" + seriesdirname + "/" + filenamestring + ".dcm";
+    }
 
-    std::string modalitystring = "";
-    if (ds.FindDataElement(gdcm::Tag(0x0008, 0x0060))) {
-      modalitystring = sf.ToString(gdcm::Tag(0x0008, 0x0060));
+    // Exports often contain the same instance more than once. Only the first copy is written,
+    // otherwise threads would race to write the same file. The output is claimed before the rules
+    // run, a copy only costs parsing the file (with --splicepixels only its header, the pixel data
+    // is not read). A copy that is skipped is recorded in the journal once the output of the first
+    // copy is on disk.
+    std::string outname = fn.substr(params->outputdir.size() + 1); // the hashed names
+    OutputClaims::Waiter self{filename, 0, 0}; // the journal line of this file
+    if (journaled) {
+      self.size = inputstat.st_size;
+      self.mtime = Journal::mtimeOf(inputstat);
+    }
+    OutputClaims::State claim = params->outputs->claim(outname, journaled ? &self : NULL);
+    if (claim != OutputClaims::Claimed) {
+      params->duplicates++;
+      if (debug_level > 0)
+        fprintf(stdout, "[%d] skip \"%s\", same output \"%s\" as a file processed before\n", params->thread, filename, fn.c_str());
+      if (journaled && claim == OutputClaims::Written) // done, its output exists
+        journal->add(true, self.size, self.mtime, filename, fn);
+      ctx.release();
+      mapped.close();
+      continue;
     }
     
     // const gdcm::Image &image = reader.GetImage();
@@ -1861,17 +2166,15 @@ void *ReadFilesThread(void *voidparams) {
     //
     // we might have some tags that should always be present, can we create those please?
     //
-    for (int i = 0; i < work.size(); i++) {
-      std::string tag1(work[i][0]);
-      std::string tag2(work[i][1]);
-      std::string which(work[i][2]);
-      if (work[i].size() <= 4 || work[i][5] != "createIfMissing") {
+    for (const Rule &rule : rules) {
+      if (!rule.createIfMissing) {
         continue;
       }
       // we have a new entry, could be createIfMissing
       // check if the key exists by asking for its value
-      int a = strtol(tag1.c_str(), NULL, 16);
-      int b = strtol(tag2.c_str(), NULL, 16);
+      const std::string &which = rule.which;
+      int a = rule.tag.GetGroup();
+      int b = rule.tag.GetElement();
       // fprintf(stderr, "Looking for %s, ", which.c_str());
       gdcm::Tag hTag(a,b);
       if (hTag.IsPrivate()) {
@@ -1951,49 +2254,36 @@ void *ReadFilesThread(void *voidparams) {
 
     /*    Tag    Name    Action */
 
-    std::string filenamestring = "";
-    std::string seriesdirname = ""; // only used if byseries is true
     //gdcm::Trace::SetDebug(true);
     //gdcm::Trace::SetWarning(true);
     //gdcm::Trace::SetError(true);
-    bool worked = AnonymizeBasedOnWork(fileToAnon, ds, trueStudyInstanceUID, params, filenamestring, seriesdirname, 0);
+    ctx.prehash(fileToAnon, ds);
+    bool worked = AnonymizeBasedOnWork(fileToAnon, ds, ctx, 0);
     
     //
     // do some more work after anonymizing
     //
     
     // hash of the patient id
-    if (params->patientid == "hashuid") {
-      if (ds.FindDataElement(gdcm::Tag(0x0010, 0x0010))) {
-        std::string val = sf.ToString(gdcm::Tag(0x0010, 0x0010));
-        std::string hash = SHA256::digestString(val).toHex();
-        anon.Replace(gdcm::Tag(0x0010, 0x0010), limitToMaxLength(gdcm::Tag(0x0010, 0x0010), hash, ds).c_str());
-      }
-    } else {
-      if (ds.FindDataElement(gdcm::Tag(0x0010, 0x0010)))
-        anon.Replace(gdcm::Tag(0x0010, 0x0010), limitToMaxLength(gdcm::Tag(0x0010, 0x0010), params->patientid, ds).c_str());
-    }
-    if (params->patientid == "hashuid") {
-      if (ds.FindDataElement(gdcm::Tag(0x0010, 0x0020))) {
-        std::string val = sf.ToString(gdcm::Tag(0x0010, 0x0020));
+    // PatientName and PatientID are looked up after the rules, Re-Mapped and createIfMissing change them
+    const gdcm::Tag patientTags[] = {gdcm::Tag(0x0010, 0x0010), gdcm::Tag(0x0010, 0x0020)};
+    for (const gdcm::Tag &tag : patientTags) {
+      const gdcm::DataElement *de = ctx.rootElement(ds, tag);
+      if (!de)
+        continue;
+      if (params->patientid == "hashuid") {
+        std::string scratch;
+        std::string val(ctx.textValue(ds, *de, scratch));
         std::string hash = SHA256::digestString(val).toHex();
-        anon.Replace(gdcm::Tag(0x0010, 0x0020), limitToMaxLength(gdcm::Tag(0x0010, 0x0020), hash, ds).c_str());
+        anon.Replace(tag, limitToMaxLength(tag, hash, ds).c_str());
+      } else {
+        anon.Replace(tag, limitToMaxLength(tag, params->patientid, ds).c_str());
       }
-    } else {
-      if (ds.FindDataElement(gdcm::Tag(0x0010, 0x0020)))
-        anon.Replace(gdcm::Tag(0x0010, 0x0020), limitToMaxLength(gdcm::Tag(0x0010, 0x0020), params->patientid, ds).c_str());
     }
 
     // We store the computed StudyInstanceUID in the StudyID tag.
     // This is used by the default setup of Sectra to identify the study (together with the AccessionNumber field).
 
-    //
-    // ISSUE: the tag can be inside of 0008,1200 (StudiesContainingOtherReferencedInstances)
-    //        In this case the reported StudyInstanceUID is not the correct UID but the first
-    //        one found - might be inside 0008,1200. This generates a new StudyInstanceUID
-    //        in the anonymized version of the data.
-    //
-    std::string anonStudyInstanceUID = sf.ToString(gdcm::Tag(0x0020, 0x000D));
     // StudyID is 16 characters long and should be hashed if it exists
     // std::string anonStudyID = sf.ToString(gdcm::Tag(0x0020, 0x0010));
     // anon.Replace(gdcm::Tag(0x0020, 0x0010), limitToMaxLength(gdcm::Tag(0x0020, 0x0010), anonStudyID, ds).c_str());
@@ -2005,62 +2295,77 @@ void *ReadFilesThread(void *voidparams) {
     
     // fprintf(stdout, "project name is: %s\n", params->projectname.c_str());
     // this is a private tag --- does not work yet - we can only remove
-    if (ds.FindDataElement(gdcm::PrivateTag(0x0013, 0x1010)))
-      anon.Remove(gdcm::PrivateTag(0x0013, 0x1010));
-
-    if (ds.FindDataElement(gdcm::PrivateTag(0x0013, 0x1013)))
-      anon.Remove(gdcm::PrivateTag(0x0013, 0x1013));
-
-    if (ds.FindDataElement(gdcm::PrivateTag(0x0013, 0x1011)))
-      anon.Remove(gdcm::PrivateTag(0x0013, 0x1011));
-    
-    if (ds.FindDataElement(gdcm::PrivateTag(0x0013, 0x1012)))
-      anon.Remove(gdcm::PrivateTag(0x0013, 0x1012));
-
-    // ok save the file again
-    std::string imageInstanceUID = filenamestring;
-    if (imageInstanceUID == "") {
-      if (debug_level > 0)
-        fprintf(stderr, "Warning: cannot read image instance uid from %s, create a new one.\n", filename);
-      gdcm::UIDGenerator gen;
-      imageInstanceUID = gen.Generate();
-      filenamestring = imageInstanceUID;
-    }
-    if (modalitystring != "") {
-      filenamestring = modalitystring + "." + filenamestring;
+    // (the private creator is only searched if the rules left anything in group 0013)
+    if (ctx.hasGroup(ds, 0x0013)) {
+      const uint16_t privateElements[] = {0x1010, 0x1013, 0x1011, 0x1012};
+      for (uint16_t e : privateElements) {
+        if (ds.FindDataElement(gdcm::PrivateTag(0x0013, e)))
+          anon.Remove(gdcm::PrivateTag(0x0013, e));
+      }
     }
 
-    std::string fn = params->outputdir + "/" + filenamestring + ".dcm";
-    if (params->byseries) {
-      // use the series instance uid as a directory name
-      std::string dn = params->outputdir + "/" + seriesdirname;
-      struct stat buffer;
-      if (!(stat(dn.c_str(), &buffer) == 0)) {
-        // DIR *dir = opendir(dn.c_str());
-        // if ( ENOENT == errno)	{
-        mkdir(dn.c_str(), 0777);
-      } // else {
-        // closedir(dir);
-      //}
-      fn = params->outputdir + "/" + seriesdirname + "/" + filenamestring + ".dcm";
+    if (debug_level > 0) {
+      if (params->queue) // we don't know yet how many files there are, show the number of files found so far instead
+        fprintf(stdout, "[%d %'zu/%'zu] write to file: %s\n", params->thread, file + 1, params->queue->numPushed(), fn.c_str());
+      else
+        fprintf(stdout, "[%d %.0f %%] write to file: %s\n", params->thread, (1.0f*params->scheduler->numCompleted())/nfiles*100.0f, fn.c_str());
     }
-
-    if (debug_level > 0)
-      fprintf(stdout, "[%d %.0f %%] write to file: %s\n", params->thread, (1.0f*file)/nfiles*100.0f, fn.c_str());
     std::string outfilename(fn);
+    // written to a temporary name first, renamed by the committer when it is complete
+    std::string tmpfilename = committer.temporaryName(outfilename);
 
     // save the file again to the output
-    gdcm::Writer writer;
-    writer.SetFile(fileToAnon);
-    writer.SetFileName(outfilename.c_str());
+    bool written = false;
+    bool background = false; // the write finishes later, aio calls the committer
+    // Once the file has its final name (or was removed) the claim is settled. The file and the copies
+    // that were skipped meanwhile are added to the journal, with a journal --fsync is file or group
+    // so the data of the file is on disk by then.
+    Journal::Buffer *jb = journaled ? journal.get() : NULL;
+    OutputCommitter::Done record = [jb, outputs = params->outputs, self, outname, outfilename](bool ok) {
+      std::vector<OutputClaims::Waiter> skipped = outputs->finished(outname, ok);
+      if (!jb)
+        return;
+      jb->add(ok, self.size, self.mtime, self.input, outfilename);
+      for (const OutputClaims::Waiter &w : skipped)
+        jb->add(ok, w.size, w.mtime, w.input, outfilename);
+    };
     try {
-      if (!writer.Write()) {
-        fprintf(stderr, "Error [#file: %d, thread: %d] writing file \"%s\" to \"%s\".\n", file, params->thread, filename, outfilename.c_str());
+      gdcm::Writer writer; // closes the output file when it goes out of scope
+      writer.SetFile(fileToAnon);
+      if (params->async && !spliced) {
+        // write into memory, the file is written in the background while we continue
+        std::ostringstream out(std::ios::binary);
+        writer.SetStream(out);
+        written = background = writer.Write() && aio.write(tmpfilename, std::move(out).str(), [&committer, outfilename, record](bool ok) {
+                                 committer.commit(outfilename, ok, record);
+                               });
+      } else {
+        writer.SetFileName(tmpfilename.c_str());
+        written = writer.Write();
+      }
+      if (!written) {
+        fprintf(stderr, "Error [#file: %zu, thread: %d] writing file \"%s\" to \"%s\".\n", file, params->thread, filename, outfilename.c_str());
       }
     } catch (const std::exception &ex) {
       std::cout << "Caught exception \"" << ex.what() << "\"\n";
     }
+    // the header is written, now the pixel data follows unchanged
+    if (written && spliced && !appendPixelData(filename, pixelStart, pixelEnd, tmpfilename)) {
+      fprintf(stderr, "Error [#file: %zu, thread: %d] copying the pixel data of \"%s\" to \"%s\".\n", file, params->thread, filename, outfilename.c_str());
+      written = false;
+    }
+    if (!background)
+      committer.commit(outfilename, written, record); // a failed file is removed, nothing truncated is left behind
+    ctx.release();
+    mapped.close();
   }
+  aio.drain();
+  committer.finish();
+  if (journal)
+    journal->flush();
+  params->iostats = aio.getStats();
+  params->commitstats = committer.getStats();
+  params->prefetchstats = readahead.getStats();
   return voidparams;
 }
 
@@ -2073,10 +2378,28 @@ void ShowFilenames(const threadparams &params) {
   std::cout << "end" << std::endl;
 }
 
-void ReadFiles(size_t nfiles, const char *filenames[], const char *outputdir, const char *patientid, int dateincrement, bool byseries, bool old_style_uid, 
-               int numthreads, const char *projectname, const char *sitename, const char *eventname, const char *siteid, std::string storeMappingAsJSON) {
+// If queue is set the files are read from the queue while it is still being filled (streaming mode),
+// nfiles and filenames are ignored in that case.
+// Fingerprint of everything that decides the content and the names of the output files (the
+// rules with the --tagchange edits, the values the rules insert, the program version). The
+// journal only skips inputs that an earlier run processed with the same fingerprint.
+static std::string runSettings(const char *patientid, int dateincrement, bool byseries, bool old_style_uid, const char *projectname, const char *sitename,
+                               const char *eventname, const char *siteid) {
+  std::string s = work.dump();
+  for (const char *v : {patientid, projectname, sitename, eventname, siteid}) {
+    s += '\n';
+    s += v;
+  }
+  s += '\n' + std::to_string(dateincrement) + (byseries ? " byseries" : "") + (old_style_uid ? " oldstyleuid" : "");
+  s += "\n" VERSION_DATE;
+  return SHA256::digestString(s).toHex();
+}
+
+void ReadFiles(size_t nfiles, const char *filenames[], const uintmax_t *filesizes, FileQueue *queue, const char *outputdir, const char *patientid, int dateincrement,
+               bool byseries, bool old_style_uid, int numthreads, const char *projectname, const char *sitename, const char *eventname, const char *siteid,
+               std::string storeMappingAsJSON, const IOOptions &io) {
   // \precondition: nfiles > 0
-  assert(nfiles > 0);
+  assert(queue || nfiles > 0);
 
   // lets change the DICOM dictionary and add some private tags - this is still not sufficient to be able to write the private tags
   gdcm::Global gl;
@@ -2117,7 +2440,7 @@ void ReadFiles(size_t nfiles, const char *filenames[], const char *outputdir, co
     unsigned short pixelsize = pixeltype.GetPixelSize();
     (void)pixelsize;
     assert(image.GetNumberOfDimensions() == 2); */
-  if (nfiles <= numthreads) {
+  if (!queue && nfiles <= numthreads) {
     numthreads = 1; // fallback if we don't have enough files to process
   }
   if (numthreads == 0) {
@@ -2130,14 +2453,45 @@ void ReadFiles(size_t nfiles, const char *filenames[], const char *outputdir, co
   pthread_t *pthread = new pthread_t[nthreads];
 
   // There is nfiles, and nThreads
-  assert(nfiles >= nthreads);
-  const size_t partition = nfiles / nthreads;
+  assert(queue || nfiles >= nthreads);
+  // Each thread starts with a contiguous block of the files, threads that finish
+  // early steal the remaining files from the others.
+  // If we know the file sizes we balance the number of bytes instead of the number of files
+  // and start with the largest files.
+  WorkStealingScheduler scheduler(nthreads);
+  // the memo of hashed uids keeps the uids of about 256k studies and series (and other repeated values)
+  ConcurrentMap uids(64, 256 * 1024), studyMapping, seriesMapping, outputdirs;
+  OutputClaims outputs;
+  Journal journal;
+  if (io.journal.length() > 0) {
+    // the same output directory given another way (relative, trailing slash) is the same run
+    std::error_code ec;
+    fs::path absoluteOutput = fs::absolute(outputdir, ec).lexically_normal();
+    if (absoluteOutput.filename().empty())
+      absoluteOutput = absoluteOutput.parent_path();
+    std::string settings = runSettings(patientid, dateincrement, byseries, old_style_uid, projectname, sitename, eventname, siteid);
+    if (!journal.open(io.journal, io.resume, io.incremental, io.durability.mode != DurabilityPolicy::None, settings,
+                      ec ? std::string(outputdir) : absoluteOutput.string()))
+      exit(-1);
+  }
+  if (debug_level > 0 && (io.resume || io.incremental))
+    fprintf(stdout, "resume: %'zu files are done according to the journal \"%s\", %'zu lines of runs with other settings or another output directory ignored\n",
+            journal.getStats().loaded, io.journal.c_str(), journal.getStats().other);
+  // In streaming mode the files arrive through the queue instead.
+  if (!queue) {
+    if (filesizes)
+      scheduler.partitionBySize(filesizes, nfiles);
+    else
+      scheduler.partition(nfiles);
+  }
   for (unsigned int thread = 0; thread < nthreads; ++thread) {
-    params[thread].filenames = filenames + thread * partition;
+    params[thread].filenames = filenames;
+    params[thread].scheduler = &scheduler;
+    params[thread].queue = queue;
     params[thread].outputdir = outputdir;
     params[thread].patientid = patientid;
     params[thread].eventname = eventname;
-    params[thread].nfiles = partition;
+    params[thread].nfiles = nfiles;
     params[thread].dateincrement = dateincrement;
     params[thread].byseries = byseries;
     params[thread].thread = thread;
@@ -2145,13 +2499,14 @@ void ReadFiles(size_t nfiles, const char *filenames[], const char *outputdir, co
     params[thread].sitename = sitename;
     params[thread].siteid = siteid;
     params[thread].old_style_uid = old_style_uid;
-    // params[thread].byThreadStudyInstanceUID
-    // params[thread].byThreadSeriesInstanceUID
-    if (thread == nthreads - 1) {
-      // There is slightly more files to process in this thread:
-      params[thread].nfiles += nfiles % nthreads;
-    }
-    assert(thread * partition < nfiles);
+    params[thread].uids = &uids;
+    params[thread].studyMapping = &studyMapping;
+    params[thread].seriesMapping = &seriesMapping;
+    params[thread].outputdirs = &outputdirs;
+    params[thread].journal = journal.isOpen() ? &journal : NULL;
+    params[thread].outputs = &outputs;
+    params[thread].duplicates = 0;
+    params[thread].io = io;
     int res = pthread_create(&pthread[thread], NULL, ReadFilesThread, &params[thread]);
     if (res) {
       if (debug_level > 0)
@@ -2159,58 +2514,104 @@ void ReadFiles(size_t nfiles, const char *filenames[], const char *outputdir, co
       assert(0);
     }
   }
-  // DEBUG
-  size_t total = 0;
-  for (unsigned int thread = 0; thread < nthreads; ++thread) {
-    total += params[thread].nfiles;
-  }
-  assert(total == nfiles);
-  // END DEBUG
 
   for (unsigned int thread = 0; thread < nthreads; thread++) {
     pthread_join(pthread[thread], NULL);
   }
 
-  // we can access the per thread storage of study instance uid mappings now
+  // DEBUG
+  size_t total = 0;
+  for (unsigned int thread = 0; !queue && thread < nthreads; ++thread) {
+    const WorkStealingScheduler::Stats &st = scheduler.stats(thread);
+    total += st.processed;
+    if (debug_level > 0)
+      fprintf(stdout, "thread %u: %'zu file%s processed, %'zu stolen from other threads in %'zu steal%s\n", thread, st.processed,
+              st.processed == 1 ? "" : "s", st.stolen, st.steals, st.steals == 1 ? "" : "s");
+  }
+  assert(queue || total == nfiles);
+  if (debug_level > 0)
+    fprintf(stdout, "uid hashing: %s, %'zu cached uids, %'zu hits, %'zu misses, %'zu evictions\n", SHA256Multi::implementationName(),
+            uids.size(), uids.hits(), uids.misses(), uids.evictions());
+  size_t duplicates = 0;
+  for (unsigned int thread = 0; thread < nthreads; ++thread)
+    duplicates += params[thread].duplicates;
+  if (debug_level > 0)
+    fprintf(stdout, "%'zu duplicate file%s skipped (same SOPInstanceUID as a file processed before)\n", duplicates, duplicates == 1 ? "" : "s");
+  if (debug_level > 0 && journal.isOpen()) {
+    Journal::Stats st = journal.getStats();
+    fprintf(stdout, "journal: %'zu files recorded in %'zu appends, %'zu skipped as done\n", st.recorded, st.appends, st.skipped);
+  }
+  if (debug_level > 0 && byseries) // before every file did a stat() of its series directory (and a mkdir() if it was missing)
+    fprintf(stdout, "series directories: %'zu created, %'zu stat calls saved\n", outputdirs.size(), outputdirs.hits() + outputdirs.size());
+  if (debug_level > 0) {
+    OutputCommitter::Stats all;
+    for (unsigned int thread = 0; thread < nthreads; ++thread) {
+      const OutputCommitter::Stats &st = params[thread].commitstats;
+      all.committed += st.committed;
+      all.failed += st.failed;
+      all.groups += st.groups;
+      all.sync.merge(st.sync);
+    }
+    fprintf(stdout, "output (--fsync %s): %'zu files committed, %'zu removed after an error, %'zu sync groups\n", io.durability.name(),
+            all.committed, all.failed, all.groups);
+    if (all.sync.calls > 0)
+      all.sync.print(stdout);
+  }
+  if (debug_level > 0 && io.asyncdepth > 0) {
+    AsyncFileIO::Stats all;
+    unsigned async = 0;
+    for (unsigned int thread = 0; thread < nthreads; ++thread) {
+      const AsyncFileIO::Stats &st = params[thread].iostats;
+      async += params[thread].async ? 1 : 0;
+      all.reads += st.reads;
+      all.writes += st.writes;
+      all.bytesRead += st.bytesRead;
+      all.bytesWritten += st.bytesWritten;
+      all.maxDepth = std::max(all.maxDepth, st.maxDepth);
+      all.depthSum += st.depthSum;
+      all.submits += st.submits;
+      all.waitSeconds += st.waitSeconds;
+      all.errors += st.errors;
+    }
+    if (async == 0)
+      fprintf(stdout, "asynchronous I/O: io_uring is not available, used blocking I/O\n");
+    else
+      fprintf(stdout, "asynchronous I/O (%u thread%s): %'zu files read (%'ju bytes), %'zu written (%'ju bytes), %'zu errors, queue depth max %zu mean %.1f, %.3fs waiting for I/O\n",
+              async, async == 1 ? "" : "s", all.reads, all.bytesRead, all.writes, all.bytesWritten, all.errors, all.maxDepth,
+              all.submits ? all.depthSum / all.submits : 0.0, all.waitSeconds);
+  }
+  if (debug_level > 0 && io.prefetchfiles > 0) {
+    ReadAhead::Stats all;
+    for (unsigned int thread = 0; thread < nthreads; ++thread) {
+      all.files += params[thread].prefetchstats.files;
+      all.bytes += params[thread].prefetchstats.bytes;
+      all.failed += params[thread].prefetchstats.failed;
+    }
+    fprintf(stdout, "read ahead: %'zu files (%'ju bytes) announced, %'zu could not be opened\n", all.files, all.bytes, all.failed);
+  }
+  // END DEBUG
+
+  // all threads are done, we can access the study instance uid mappings now
   if (storeMappingAsJSON.length() > 0) {
     std::map<std::string, std::string> uidmappings1;
-    std::map<std::string, std::string> uidmappings2;
-    for (unsigned int thread = 0; thread < nthreads; thread++) {
-      for (std::map<std::string, std::string>::iterator it = params[thread].byThreadStudyInstanceUID.begin();
-           it != params[thread].byThreadStudyInstanceUID.end(); ++it) {
-        std::string key = it->first;
-        //key.erase(key.find_last_not_of(" \n\r\t")+1);
-        std::string value = it->second;
-        //value.erase(key.find_last_not_of(" \n\r\t")+1);
-        if (key.length() > 1 && key[key.length()-1] == '\0') {
-          std::string::iterator it = key.end() -1;
-          key.erase(it);
-        }
-        if (value.length() > 1 && value[value.length()-1] == '\0') {
-          std::string::iterator it = value.end() -1;
-          value.erase(it);
-        }	
-        uidmappings1.insert(std::pair<std::string, std::string>(key, value));
-      }
-    }
-    for (unsigned int thread = 0; thread < nthreads; thread++) {
-      for (std::map<std::string, std::string>::iterator it = params[thread].byThreadSeriesInstanceUID.begin();
-           it != params[thread].byThreadSeriesInstanceUID.end(); ++it) {
-        std::string key = it->first;
-        //key.erase(key.find_last_not_of(" \n\r\t")+1);
-        std::string value = it->second;
-        //value.erase(key.find_last_not_of(" \n\r\t")+1);
-        if (key.length() > 1 && key[key.length()-1] == '\0') {
-          std::string::iterator it = key.end() -1;
-          key.erase(it);
-        }
-        if (value.length() > 1 && value[value.length()-1] == '\0') {
-          std::string::iterator it = value.end() -1;
-          value.erase(it);
-        }
-        uidmappings2.insert(std::pair<std::string, std::string>(key, value));
+    std::map<std::string, std::string> studies = studyMapping.sorted();
+    for (std::map<std::string, std::string>::iterator it = studies.begin(); it != studies.end(); ++it) {
+      std::string key = it->first;
+      //key.erase(key.find_last_not_of(" \n\r\t")+1);
+      std::string value = it->second;
+      //value.erase(key.find_last_not_of(" \n\r\t")+1);
+      if (key.length() > 1 && key[key.length()-1] == '\0') {
+        std::string::iterator it = key.end() -1;
+        key.erase(it);
       }
+      if (value.length() > 1 && value[value.length()-1] == '\0') {
+        std::string::iterator it = value.end() -1;
+        value.erase(it);
+      }	
+      uidmappings1.insert(std::pair<std::string, std::string>(key, value));
     }
+    // series keys and values had their trailing null removed when they were stored
+    std::map<std::string, std::string> uidmappings2 = seriesMapping.sorted();
     nlohmann::json ar;
     ar["StudyInstanceUID"] = {};
     ar["SeriesInstanceUID"] = {};
@@ -2257,6 +2658,19 @@ enum optionIndex {
   SITEID,
   REGTAGCHANGE,
   OLDSTYLEUID,
+  SIZEORDER,
+  STREAM,
+  WALKTHREADS,
+  SPLICEPIXELS,
+  MMAPINPUT,
+  HUGEPAGES,
+  ASYNCIO,
+  PREFETCH,
+  PREFETCHWINDOW,
+  FSYNC,
+  JOURNAL,
+  RESUME,
+  INCREMENTAL,
   VERBOSE,
   VERSION
 };
@@ -2284,10 +2698,29 @@ const option::Descriptor usage[] = {
     {OLDSTYLEUID,   0, "u", "oldstyleuid", Arg::None,
      "  --oldstyleuid, -u  \tFlag to allow alpha-numeric characters as UIDs (deprecated). Default is to only generate standard conformant UIDs with characters '0'-'9' and '.'."},
     {STOREMAPPING,  0, "m", "storemapping", Arg::None, "  --storemapping, -m  \tFlag to store the StudyInstanceUID mapping as a JSON file."},
-    {TAGCHANGE,     0, "P", "tagchange", Arg::Required, "  --tagchange, -P  \tChanges the default behavior for a tag in the build-in rules."},
+    {TAGCHANGE,     0, "P", "tagchange", Arg::Required, "  --tagchange, -P  \tChanges the default behavior for a tag in the build-in rules (\"0010,0010=ANON\", group and element in hex, case and leading zeros do not matter)."},
     {REGTAGCHANGE,  0, "R", "regtagchange", Arg::Required,
      "  --regtagchange, -R  \tChanges the default behavior for a tag in the build-in rules (understands regular expressions, retains all capturing groups)."},
     {NUMTHREADS,    0, "t", "numthreads", Arg::Required, "  --numthreads, -t  \tHow many threads should be used (default 4)."},
+    {SIZEORDER,     0, "z", "sizeorder", Arg::None,
+     "  --sizeorder, -z  \tFlag to process the largest files first and to balance the number of bytes instead of the number of files between threads."},
+    {STREAM,        0, "x", "stream", Arg::None,
+     "  --stream, -x  \tFlag to start anonymizing while the input directory is still searched for files."},
+    {WALKTHREADS,   0, "y", "walkthreads", Arg::Required,
+     "  --walkthreads, -y  \tHow many threads should search the input directory in streaming mode (default 1)."},
+    {SPLICEPIXELS,  0, "k", "splicepixels", Arg::None,
+     "  --splicepixels, -k  \tFlag to read files only up to the pixel data and to copy the pixel data unchanged into the output file."},
+    {MMAPINPUT,     0, "g", "mmap", Arg::None, "  --mmap, -g  \tFlag to read the input files through a memory mapping instead of a file stream."},
+    {HUGEPAGES,     0, "H", "hugepages", Arg::None, "  --hugepages, -H  \tFlag to ask for transparent huge pages for the memory mapped input files (with --mmap)."},
+    {ASYNCIO,       0, "A", "asyncio", Arg::Required, "  --asyncio, -A  \tRead up to this many files ahead and write the output files in the background with io_uring (Linux, default 0: blocking I/O)."},
+    {PREFETCH,      0, "F", "prefetch", Arg::Required, "  --prefetch, -F  \tAsk the kernel to read the next this many files of each thread into the page cache (posix_fadvise, for network storage)."},
+    {PREFETCHWINDOW, 0, "W", "prefetchwindow", Arg::Required, "  --prefetchwindow, -W  \tAt most this many bytes are read ahead per thread with --prefetch (default 67108864)."},
+    {FSYNC,         0, "S", "fsync", Arg::Required,
+     "  --fsync, -S  \tDurability of the output files: none (default without --journal), file (fsync every file before it gets its final name) or group[:N[:M]] (syncfs after N files or M ms, default 64 and 1000, the time is checked between files)."},
+    {JOURNAL,       0, "J", "journal", Arg::Required, "  --journal, -J  \tAppend every processed file to this journal (input size and time, input and output path). A file is only recorded once its output is on disk, this needs --fsync file or group (the default with --journal)."},
+    {RESUME,        0, "r", "resume", Arg::None, "  --resume, -r  \tSkip the input files the journal (--journal) has as done and not changed since. Only lines of earlier runs with the same output directory, rules and options (project, patient id, date increment, ...) count."},
+    {INCREMENTAL,   0, "I", "incremental", Arg::None,
+     "  --incremental, -I  \tLike --resume but a file is only skipped if its output file still exists and is newer than the input file (reruns over mostly unchanged folders)."},
     {VERSION,       0, "v", "version", Arg::None, "  --version, -v  \tPrint version number."},
     {VERBOSE,       0, "l", "debug", Arg::None, "  --debug, -l  \tPrint debug messages. Can be used more than once."},
     {UNKNOWN,       0, "", "", Arg::None,
@@ -2298,14 +2731,19 @@ const option::Descriptor usage[] = {
      "            --exportanon rules.json\n"},
     {0, 0, 0, 0, 0, 0}};
 
-// TODO: would be good to start anonymizing already while its still trying to find more files...
-std::vector<std::string> listFiles(const std::string &path) {
+// Use streamFiles() to start anonymizing already while its still trying to find more files.
+// The size of each file is returned in sizes (same order as the returned file names).
+std::vector<std::string> listFiles(const std::string &path, std::vector<uintmax_t> &sizes) {
   std::vector<std::string> files;
   using recursive_directory_iterator = std::filesystem::recursive_directory_iterator;
   for (const auto& dirEntry : recursive_directory_iterator(path)) {
     //std::cout << dirEntry << std::endl;
-    if (fs::is_regular_file(dirEntry.path())) {
+    // the directory entry caches the file type, file_size() is the only stat we need per file
+    if (dirEntry.is_regular_file()) {
+      std::error_code ec;
+      uintmax_t size = dirEntry.file_size(ec);
       files.push_back(dirEntry.path());
+      sizes.push_back(ec ? 0 : size);
       if (files.size() % 100 == 0 && debug_level > 0) {
         fprintf(stdout, "\rreading files (%'lu) ...", files.size());
         fflush(stdout);
@@ -2315,6 +2753,20 @@ std::vector<std::string> listFiles(const std::string &path) {
   return files;
 }
 
+// Walk the directory tree with walkthreads threads and push each regular file into the queue (streaming mode).
+// The queue is closed once the walk is finished.
+void streamFiles(const std::string &path, FileQueue *queue, int walkthreads) {
+  DirectoryWalker walker([queue](std::string &&filename) { queue->push(std::move(filename)); });
+  walker.run(path, std::max(walkthreads, 1));
+  queue->close();
+  if (debug_level > 0) {
+    const DirectoryWalker::Stats &st = walker.getStats();
+    // if this rate is about the rate files are processed the walk is the bottleneck, use more --walkthreads
+    fprintf(stdout, "directory walk: %'zu files in %'zu directories (%'zu entries) in %.2fs, %'.0f entries/s\n", st.files, st.directories, st.entries,
+            st.seconds, st.seconds > 0 ? st.entries / st.seconds : 0.0);
+  }
+}
+
 int main(int argc, char *argv[]) {
 
   setlocale(LC_NUMERIC, "");
@@ -2352,6 +2804,11 @@ int main(int argc, char *argv[]) {
   std::string exportanonfilename = ""; // anon.json
   bool byseries = false;
   bool old_style_uid = false; // default is that we do not use old style alphanumeric characters in uid
+  bool sizeorder = false;     // default is to process files in the order they are found
+  bool stream = false;        // default is to find all files before processing starts
+  int walkthreads = 1;
+  IOOptions io;
+  bool fsyncGiven = false; // --fsync was set on the command line
   int numthreads = 4;
   std::string projectname = "";
   std::string storeMappingAsJSON = "";
@@ -2465,6 +2922,101 @@ int main(int argc, char *argv[]) {
           fprintf(stdout, "--oldstyleuid\n");
         old_style_uid = true;
         break;
+      case SIZEORDER:
+        if (debug_level > 0)
+          fprintf(stdout, "--sizeorder\n");
+        sizeorder = true;
+        break;
+      case STREAM:
+        if (debug_level > 0)
+          fprintf(stdout, "--stream\n");
+        stream = true;
+        break;
+      case WALKTHREADS:
+        if (opt.arg) {
+          if (debug_level > 0)
+            fprintf(stdout, "--walkthreads %d\n", atoi(opt.arg));
+          walkthreads = atoi(opt.arg);
+        } else {
+          fprintf(stderr, "Error: --walkthreads needs an integer specified\n");
+          exit(-1);
+        }
+        break;
+      case SPLICEPIXELS:
+        if (debug_level > 0)
+          fprintf(stdout, "--splicepixels\n");
+        io.splicepixels = true;
+        break;
+      case MMAPINPUT:
+        if (debug_level > 0)
+          fprintf(stdout, "--mmap\n");
+        io.mmapinput = true;
+        break;
+      case HUGEPAGES:
+        if (debug_level > 0)
+          fprintf(stdout, "--hugepages\n");
+        io.hugepages = true;
+        break;
+      case ASYNCIO:
+        if (opt.arg && atoi(opt.arg) >= 0) {
+          if (debug_level > 0)
+            fprintf(stdout, "--asyncio %d\n", atoi(opt.arg));
+          io.asyncdepth = atoi(opt.arg);
+        } else {
+          fprintf(stderr, "Error: --asyncio needs a non-negative integer specified\n");
+          exit(-1);
+        }
+        break;
+      case PREFETCH:
+        if (opt.arg && atoi(opt.arg) >= 0) {
+          if (debug_level > 0)
+            fprintf(stdout, "--prefetch %d\n", atoi(opt.arg));
+          io.prefetchfiles = atoi(opt.arg);
+        } else {
+          fprintf(stderr, "Error: --prefetch needs a non-negative integer specified\n");
+          exit(-1);
+        }
+        break;
+      case PREFETCHWINDOW:
+        if (opt.arg && strtoull(opt.arg, NULL, 10) > 0) {
+          if (debug_level > 0)
+            fprintf(stdout, "--prefetchwindow %llu\n", strtoull(opt.arg, NULL, 10));
+          io.prefetchwindow = strtoull(opt.arg, NULL, 10);
+        } else {
+          fprintf(stderr, "Error: --prefetchwindow needs a positive number of bytes specified\n");
+          exit(-1);
+        }
+        break;
+      case FSYNC:
+        if (opt.arg && io.durability.parse(opt.arg)) {
+          fsyncGiven = true;
+          if (debug_level > 0)
+            fprintf(stdout, "--fsync %s\n", opt.arg);
+        } else {
+          fprintf(stderr, "Error: --fsync needs none, file, group, group:N or group:N:M\n");
+          exit(-1);
+        }
+        break;
+      case JOURNAL:
+        if (opt.arg) {
+          if (debug_level > 0)
+            fprintf(stdout, "--journal %s\n", opt.arg);
+          io.journal = opt.arg;
+        } else {
+          fprintf(stderr, "Error: --journal needs a filename\n");
+          exit(-1);
+        }
+        break;
+      case RESUME:
+        if (debug_level > 0)
+          fprintf(stdout, "--resume\n");
+        io.resume = true;
+        break;
+      case INCREMENTAL:
+        if (debug_level > 0)
+          fprintf(stdout, "--incremental\n");
+        io.incremental = true;
+        break;
       case VERBOSE:
         if (debug_level > 0)
           fprintf(stdout, "--debug\n");
@@ -2498,6 +3050,10 @@ int main(int argc, char *argv[]) {
           }
           tag1 = front.substr(0, posComma);
           tag2 = front.substr(posComma + 1, std::string::npos);
+          if (!canonicalTagPart(tag1, tag1) || !canonicalTagPart(tag2, tag2)) {
+            fprintf(stderr, "Error: --tagchange error, group and element need to be 1 to 4 hex digits like \"0010,0010\"\n");
+            exit(-1);
+          }
           // fprintf(stdout, "got a tagchange of %s,%s = %s\n", tag1.c_str(), tag2.c_str(), res.c_str());
           int a = strtol(tag1.c_str(), NULL, 16);
           int b = strtol(tag2.c_str(), NULL, 16); // did this work? we should check here and not just add
@@ -2555,6 +3111,10 @@ int main(int argc, char *argv[]) {
           }
           tag1 = front.substr(0, posComma);
           tag2 = front.substr(posComma + 1, std::string::npos);
+          if (!canonicalTagPart(tag1, tag1) || !canonicalTagPart(tag2, tag2)) {
+            fprintf(stderr, "Error: --regtagchange error, group and element need to be 1 to 4 hex digits like \"0010,0010\"\n");
+            exit(-1);
+          }
           if (debug_level > 0)
             fprintf(stdout, "got a regtagchange of %s,%s = %s\n", tag1.c_str(), tag2.c_str(), res.c_str());
           int a = strtol(tag1.c_str(), NULL, 16);
@@ -2659,6 +3219,21 @@ int main(int argc, char *argv[]) {
         break;
     }
   }
+  if ((io.resume || io.incremental) && io.journal.empty()) {
+    fprintf(stderr, "Error: --resume and --incremental need the journal of the earlier run (--journal)\n");
+    exit(-1);
+  }
+  // an ok line in the journal has to mean the output file is on disk, otherwise --resume would
+  // skip inputs whose output was lost (or is truncated) after a crash of the machine
+  if (!io.journal.empty() && io.durability.mode == DurabilityPolicy::None) {
+    if (fsyncGiven) {
+      fprintf(stderr, "Error: --journal needs --fsync file or group, with none the journal could list outputs that are not on disk\n");
+      exit(-1);
+    }
+    io.durability.mode = DurabilityPolicy::Group;
+    if (debug_level > 0)
+      fprintf(stdout, "--fsync group (default with --journal)\n");
+  }
   // based on the debug_level we can disable the warnings and error messages from gdcm
   if (debug_level > 1) {
      gdcm::Trace::DebugOn();
@@ -2672,8 +3247,29 @@ int main(int argc, char *argv[]) {
   size_t nfiles = 0;
 
   // Check if user pass in a single directory
-  if (gdcm::System::FileIsDirectory(input.c_str())) {
-    std::vector<std::string> files = listFiles(input.c_str());
+  if (stream && gdcm::System::FileIsDirectory(input.c_str())) {
+    if (storeMappingAsJSON.length() > 0) {
+      storeMappingAsJSON = output + std::string("/") + storeMappingAsJSON;
+    }
+    if (sizeorder)
+      fprintf(stderr, "Warning: --sizeorder is ignored in streaming mode, file sizes are not known in advance.\n");
+    compileRules(projectname, patientID, eventname, sitename);
+
+    // the queue holds a bounded number of file names, the walker waits if the workers fall behind
+    FileQueue queue(256 * std::max(numthreads, 1));
+    std::thread walker(streamFiles, input, &queue, walkthreads);
+    ReadFiles(0, NULL, NULL, &queue, output.c_str(), patientID.c_str(), dateincrement, byseries, old_style_uid, numthreads, projectname.c_str(),
+              sitename.c_str(), eventname.c_str(), siteid.c_str(), storeMappingAsJSON, io);
+    walker.join();
+    nfiles = queue.numPushed();
+    if (nfiles == 0) {
+      fprintf(stderr, "No files found.\n");
+      fflush(stderr);
+      exit(-1);
+    }
+  } else if (gdcm::System::FileIsDirectory(input.c_str())) {
+    std::vector<uintmax_t> sizes;
+    std::vector<std::string> files = listFiles(input.c_str(), sizes);
 
     nfiles = files.size();
     const char **filenames = new const char *[nfiles];
@@ -2689,14 +3285,14 @@ int main(int argc, char *argv[]) {
       exit(-1);
     }
 
-    // before we try to anonymize our files we should create a cache of work,
+    // before we try to anonymize our files we should compile the rules in work,
     // We need to know if a tag is going to be anonymized (based on group element) and where
-    // in work the corresponding entry can be found.
-    createWorkCache();
+    // in rules the corresponding entry can be found.
+    compileRules(projectname, patientID, eventname, sitename);
 
     // ReadFiles(nfiles, filenames, output.c_str(), numthreads, confidence, storeMappingAsJSON);
-    ReadFiles(nfiles, filenames, output.c_str(), patientID.c_str(), dateincrement, byseries, old_style_uid, numthreads, projectname.c_str(), sitename.c_str(),
-              eventname.c_str(), siteid.c_str(), storeMappingAsJSON);
+    ReadFiles(nfiles, filenames, sizeorder ? sizes.data() : NULL, NULL, output.c_str(), patientID.c_str(), dateincrement, byseries, old_style_uid, numthreads,
+              projectname.c_str(), sitename.c_str(), eventname.c_str(), siteid.c_str(), storeMappingAsJSON, io);
     delete[] filenames;
   } else {
     // its a single file, process that
@@ -2711,8 +3307,8 @@ int main(int argc, char *argv[]) {
     filenames[0] = input.c_str();
     nfiles = 1;
     // ReadFiles(1, filenames, output.c_str(), 1, confidence, storeMappingAsJSON);
-    ReadFiles(nfiles, filenames, output.c_str(), patientID.c_str(), dateincrement, byseries, old_style_uid, numthreads, projectname.c_str(), sitename.c_str(), eventname.c_str(),
-              siteid.c_str(), storeMappingAsJSON);
+    ReadFiles(nfiles, filenames, NULL, NULL, output.c_str(), patientID.c_str(), dateincrement, byseries, old_style_uid, numthreads, projectname.c_str(), sitename.c_str(),
+              eventname.c_str(), siteid.c_str(), storeMappingAsJSON, io);
   }
   if (debug_level > 0)
     fprintf(stdout, "Done [%'zu file%s processed].\n", nfiles, nfiles==1?"":"s");
@@ -0,0 +1,424 @@
+#ifndef INCLUDE_ASYNCIO_HPP_
+#define INCLUDE_ASYNCIO_HPP_
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define ASYNCIO_URING 1
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
+#include "fileio.h"
+
+// Minimal io_uring wrapper (submission and completion rings through the raw system calls,
+// liburing is not needed). init() fails if the kernel does not support io_uring or if it is
+// blocked (seccomp in containers), the caller uses blocking I/O in that case.
+class IOUring {
+public:
+  IOUring() {}
+  ~IOUring() { close(); }
+  IOUring(const IOUring &) = delete;
+  IOUring &operator=(const IOUring &) = delete;
+
+#ifdef ASYNCIO_URING
+  bool init(unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (fd < 0)
+      return false;
+    ringfd = fd;
+    sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single)
+      sqRingSize = cqRingSize = sqRingSize > cqRingSize ? sqRingSize : cqRingSize;
+    sqRing = mmap(NULL, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sqRing == MAP_FAILED) {
+      sqRing = NULL;
+      close();
+      return false;
+    }
+    if (single) {
+      cqRing = sqRing;
+    } else {
+      cqRing = mmap(NULL, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+      if (cqRing == MAP_FAILED) {
+        cqRing = NULL;
+        close();
+        return false;
+      }
+    }
+    sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = (struct io_uring_sqe *)mmap(NULL, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+      sqes = NULL;
+      close();
+      return false;
+    }
+    char *sq = (char *)sqRing, *cq = (char *)cqRing;
+    sqHead = (unsigned *)(sq + p.sq_off.head);
+    sqTail = (unsigned *)(sq + p.sq_off.tail);
+    sqMask = (unsigned *)(sq + p.sq_off.ring_mask);
+    sqArray = (unsigned *)(sq + p.sq_off.array);
+    cqHead = (unsigned *)(cq + p.cq_off.head);
+    cqTail = (unsigned *)(cq + p.cq_off.tail);
+    cqMask = (unsigned *)(cq + p.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    sqEntries = p.sq_entries;
+    tail = *sqTail;
+    return true;
+  }
+
+  // queue a read or write, returns false if the submission ring is full
+  bool prepare(bool write, int fd, void *buf, uint32_t length, uint64_t offset, uint64_t userdata) {
+    unsigned head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+    if (tail - head >= sqEntries)
+      return false;
+    unsigned idx = tail & *sqMask;
+    struct io_uring_sqe *sqe = &sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = length;
+    sqe->off = offset;
+    sqe->user_data = userdata;
+    sqArray[idx] = idx;
+    tail++;
+    return true;
+  }
+
+  // hand the prepared entries to the kernel, with wait block until at least one completion is there
+  bool submit(bool wait) {
+    __atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+    unsigned toSubmit = tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+    for (;;) {
+      long r = syscall(__NR_io_uring_enter, ringfd, toSubmit, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+      if (r >= 0)
+        return true;
+      if (errno != EINTR)
+        return false;
+    }
+  }
+
+  // take one completion if there is one
+  bool complete(uint64_t &userdata, int &result) {
+    unsigned head = *cqHead;
+    if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+      return false;
+    const struct io_uring_cqe &cqe = cqes[head & *cqMask];
+    userdata = cqe.user_data;
+    result = cqe.res;
+    __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+    return true;
+  }
+
+  void close() {
+    if (sqes)
+      munmap(sqes, sqesSize);
+    if (cqRing && cqRing != sqRing)
+      munmap(cqRing, cqRingSize);
+    if (sqRing)
+      munmap(sqRing, sqRingSize);
+    if (ringfd >= 0)
+      ::close(ringfd);
+    sqes = NULL;
+    sqRing = cqRing = NULL;
+    ringfd = -1;
+  }
+
+private:
+  int ringfd = -1;
+  void *sqRing = NULL, *cqRing = NULL;
+  size_t sqRingSize = 0, cqRingSize = 0, sqesSize = 0;
+  struct io_uring_sqe *sqes = NULL;
+  struct io_uring_cqe *cqes = NULL;
+  unsigned *sqHead = NULL, *sqTail = NULL, *sqMask = NULL, *sqArray = NULL;
+  unsigned *cqHead = NULL, *cqTail = NULL, *cqMask = NULL;
+  unsigned sqEntries = 0;
+  unsigned tail = 0; // our submission tail, published in submit()
+#else
+  bool init(unsigned) { return false; }
+  bool prepare(bool, int, void *, uint32_t, uint64_t, uint64_t) { return false; }
+  bool submit(bool) { return false; }
+  bool complete(uint64_t &, int &) { return false; }
+  void close() {}
+#endif
+};
+
+// Asynchronous reads and writes of whole files for one worker thread.
+//
+// The worker announces the files it will process next with prefetch(), their content is read
+// in the background into memory while the worker anonymizes the current file. take() waits
+// for the data of a file. Output files are written with write(), the worker continues with the
+// next file while the data goes to disk. Every thread has its own ring, nothing is shared.
+//
+// Files larger than maxFileSize are not prefetched (take() returns false and the caller reads
+// the file itself) to keep the memory of depth files in flight bounded.
+class AsyncFileIO {
+public:
+  struct Stats {
+    size_t reads = 0;          // files read in the background
+    size_t writes = 0;         // files written in the background
+    uintmax_t bytesRead = 0;
+    uintmax_t bytesWritten = 0;
+    size_t maxDepth = 0;       // largest number of operations in flight
+    double depthSum = 0;       // sum of the operations in flight at each submit
+    size_t submits = 0;
+    double waitSeconds = 0;    // time the worker was blocked waiting for I/O
+    size_t errors = 0;         // failed writes
+  };
+
+  AsyncFileIO(unsigned depth, uintmax_t maxFileSize = 64 << 20) : depth(depth), maxFileSize(maxFileSize) {}
+  ~AsyncFileIO() { drain(); }
+
+  // returns false if io_uring cannot be used, the caller keeps the blocking path then
+  bool start() { return depth > 0 && ring.init(ringEntries()); }
+
+  // start reading a file in the background
+  void prefetch(const std::string &filename) {
+    reads.emplace_back();
+    Request &r = reads.back(); // stays in place until it is taken, the ops point to it
+    r.filename = filename;
+    r.fd = open(filename.c_str(), O_RDONLY);
+    struct stat st;
+    if (r.fd < 0 || fstat(r.fd, &st) != 0 || !S_ISREG(st.st_mode) || (uintmax_t)st.st_size > maxFileSize) {
+      r.failed = true; // the caller will read this file the usual way
+    } else {
+      r.data.resize((size_t)st.st_size);
+      queueOps(r, false);
+    }
+    flush();
+  }
+
+  // the content of the file (the next one that was prefetched), returns false if the caller
+  // needs to read the file itself
+  bool take(const std::string &filename, std::vector<char> &data) {
+    while (!reads.empty() && reads.front().filename != filename) // should not happen, files are taken in order
+      finishRead(reads.front(), data);
+    if (reads.empty())
+      return false;
+    return finishRead(reads.front(), data);
+  }
+
+  // write data to filename in the background, done is called with the result once the file
+  // is written and closed
+  bool write(const std::string &filename, std::string &&data, std::function<void(bool ok)> done = nullptr) {
+    Request r;
+    r.filename = filename;
+    r.fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (r.fd < 0)
+      return false;
+    r.out = std::move(data);
+    r.done = std::move(done);
+    uint64_t id = nextId++;
+    writes.emplace(id, std::move(r));
+    Request &w = writes[id];
+    w.id = id;
+    stats.writes++;
+    stats.bytesWritten += w.out.size();
+    if (w.out.empty()) {
+      finishWrite(id);
+      return true;
+    }
+    queueOps(w, true);
+    flush();
+    // keep the memory of the writes in flight bounded
+    while (writes.size() > depth)
+      reap(true);
+    return true;
+  }
+
+  // wait until all writes are on disk (in the page cache)
+  void drain() {
+    while (!writes.empty() || !ops.empty())
+      if (!reap(true))
+        break;
+    std::vector<char> unused;
+    while (!reads.empty())
+      finishRead(reads.front(), unused);
+  }
+
+  const Stats &getStats() const { return stats; }
+
+private:
+  struct Request {
+    uint64_t id = 0;
+    std::string filename;
+    int fd = -1;
+    std::vector<char> data; // read buffer
+    std::string out;        // write buffer
+    std::function<void(bool ok)> done; // called when the write is finished
+    size_t pending = 0;     // operations in flight
+    bool failed = false;
+  };
+  struct Op {
+    bool write;
+    uint64_t request; // id of the write, reads are found by filename
+    Request *read;    // the read request (reads do not move, they stay in the deque)
+    uint64_t offset;
+    uint32_t length;
+  };
+
+  static const uint32_t chunk = 1 << 24; // largest single read or write
+
+  unsigned ringEntries() const {
+    unsigned n = 8;
+    while (n < 4 * depth && n < 4096)
+      n <<= 1;
+    return n;
+  }
+
+  void queueOps(Request &r, bool write) {
+    size_t size = write ? r.out.size() : r.data.size();
+    for (uint64_t off = 0; off < size; off += chunk) {
+      Op op;
+      op.write = write;
+      op.request = r.id;
+      op.read = write ? NULL : &r;
+      op.offset = off;
+      op.length = (uint32_t)(size - off < chunk ? size - off : chunk);
+      uint64_t key = nextOp++;
+      char *buf = write ? &r.out[0] : r.data.data();
+      while (!ring.prepare(write, r.fd, buf + off, op.length, off, key)) {
+        flush();
+        reap(true); // the submission ring is full, make some room
+      }
+      ops.emplace(key, op);
+      r.pending++;
+    }
+  }
+
+  void flush() {
+    stats.submits++;
+    stats.depthSum += ops.size();
+    if (ops.size() > stats.maxDepth)
+      stats.maxDepth = ops.size();
+    ring.submit(false);
+  }
+
+  // process completions, with wait block for at least one, returns false if nothing is in flight
+  bool reap(bool wait) {
+    if (ops.empty())
+      return false;
+    uint64_t key;
+    int res;
+    bool any = false;
+    while (ring.complete(key, res)) {
+      any = true;
+      completeOp(key, res);
+    }
+    if (!any && wait) {
+      auto t0 = std::chrono::steady_clock::now();
+      if (!ring.submit(true))
+        return false;
+      stats.waitSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+      while (ring.complete(key, res))
+        completeOp(key, res);
+    }
+    return true;
+  }
+
+  void completeOp(uint64_t key, int res) {
+    auto it = ops.find(key);
+    if (it == ops.end())
+      return;
+    Op op = it->second;
+    ops.erase(it);
+    if (op.write) {
+      auto w = writes.find(op.request);
+      if (w == writes.end())
+        return;
+      Request &r = w->second;
+      if (res < (int)op.length) { // error or short write, finish this part with a blocking write
+        size_t done = res > 0 ? (size_t)res : 0;
+        if (!pwriteAll(r.fd, r.out.data() + op.offset + done, op.length - done, op.offset + done))
+          r.failed = true;
+      }
+      if (--r.pending == 0)
+        finishWrite(op.request);
+    } else {
+      Request &r = *op.read;
+      if (res != (int)op.length) // error or short read, the file is read again synchronously
+        r.failed = true;
+      r.pending--;
+    }
+  }
+
+  bool finishRead(Request &r, std::vector<char> &data) {
+    while (r.pending > 0)
+      if (!reap(true))
+        break;
+    bool ok = !r.failed && r.pending == 0 && r.fd >= 0;
+    if (ok) {
+      stats.reads++;
+      stats.bytesRead += r.data.size();
+      data.swap(r.data);
+    }
+    if (r.fd >= 0)
+      close(r.fd);
+    reads.pop_front();
+    return ok;
+  }
+
+  void finishWrite(uint64_t id) {
+    auto w = writes.find(id);
+    if (w == writes.end())
+      return;
+    Request &r = w->second;
+    if (close(r.fd) != 0)
+      r.failed = true;
+    if (r.failed) {
+      stats.errors++;
+      fprintf(stderr, "Error: writing file \"%s\" failed.\n", r.filename.c_str());
+    }
+    std::function<void(bool)> done = std::move(r.done);
+    bool ok = !r.failed;
+    writes.erase(w);
+    if (done)
+      done(ok);
+  }
+
+  static bool pwriteAll(int fd, const char *p, size_t n, uint64_t offset) {
+    while (n > 0) {
+      ssize_t w = pwrite(fd, p, n, (off_t)offset);
+      if (w < 0 && errno == EINTR)
+        continue;
+      if (w <= 0)
+        return false;
+      p += w;
+      n -= w;
+      offset += w;
+    }
+    return true;
+  }
+
+  unsigned depth;
+  uintmax_t maxFileSize;
+  IOUring ring;
+  std::deque<Request> reads; // prefetched files in the order they will be taken
+  std::unordered_map<uint64_t, Request> writes;
+  std::unordered_map<uint64_t, Op> ops;
+  uint64_t nextId = 1;
+  uint64_t nextOp = 1;
+  Stats stats;
+};
+
+#endif /* INCLUDE_ASYNCIO_HPP_ */
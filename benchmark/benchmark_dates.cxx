@@ -0,0 +1,184 @@
+// Micro benchmark of the date shift (DateShifter in dateshift.h on top of dateprocessing.h)
+// against the sscanf, std::chrono and snprintf code that incrementdate and incrementdatetime
+// used before. Every thread has its own DateShifter and shifts its own DA and DT values (full
+// and partial precision, with time and UTC offset, and out of range ones) by its own number of
+// days, the results have to be the same as the ones of the old code. The threads also convert
+// all days from 0001-01-01 to 9999-12-31 to day numbers and back and compare them with
+// std::chrono.
+//
+//   benchmark_dates [values per thread] [threads]
+
+#include "dateshift.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+// the code before DateShifter
+namespace old {
+void addDays(struct sdate &date1, int days) {
+  std::chrono::year_month_day _ymd(std::chrono::year(date1.y), std::chrono::month(date1.m), std::chrono::day(date1.d));
+  _ymd = std::chrono::sys_days{_ymd} + std::chrono::days{days};
+  date1.y = static_cast<int>(_ymd.year());
+  date1.m = static_cast<unsigned>(_ymd.month());
+  date1.d = static_cast<unsigned>(_ymd.day());
+}
+
+bool incrementdate(const std::string &val, int nd, std::string &result) {
+  struct sdate date1;
+  if (sscanf(val.c_str(), "%04ld%02ld%02ld", &date1.y, &date1.m, &date1.d) != 3)
+    return false;
+  addDays(date1, nd);
+  char dat[256];
+  snprintf(dat, 256, "%04ld%02ld%02ld", date1.y, date1.m, date1.d);
+  result = dat;
+  return true;
+}
+
+bool incrementdatetime(const std::string &val, int nd, std::string &result) {
+  struct sdate date1;
+  char t[245];
+  char dat[256];
+  int numParsedDateObjects = sscanf(val.c_str(), "%04ld%02ld%02ld%s", &date1.y, &date1.m, &date1.d, t);
+  if (numParsedDateObjects == 4) {
+    addDays(date1, nd);
+    snprintf(dat, 256, "%04ld%02ld%02ld%s%s", date1.y, date1.m, date1.d, t, (((strlen(t) % 2) == 0) ? "" : " "));
+  } else if (numParsedDateObjects == 3) {
+    addDays(date1, nd);
+    snprintf(dat, 256, "%04ld%02ld%02ld", date1.y, date1.m, date1.d);
+  } else if (numParsedDateObjects == 2) {
+    date1.d = 1;
+    addDays(date1, nd);
+    snprintf(dat, 256, "%04ld%02ld", date1.y, date1.m);
+  } else if (numParsedDateObjects == 1) {
+    date1.d = 1;
+    date1.m = 1;
+    addDays(date1, nd);
+    snprintf(dat, 256, "%04ld", date1.y);
+  } else {
+    return false;
+  }
+  result = dat;
+  return true;
+}
+} // namespace old
+
+struct Value {
+  std::string text;
+  bool datetime;
+};
+
+static std::vector<Value> makeValues(size_t n, unsigned seed) {
+  static const char *times[] = {"", "12", "1230", "123059", "123059.5", "123059.123456", "123059+0100", "0000-1130"};
+  std::mt19937 rng(seed);
+  std::vector<Value> values(n);
+  char buf[64];
+  for (size_t i = 0; i < n; i++) {
+    long y = 1900 + rng() % 150, m = 1 + rng() % 12, d = 1 + rng() % 31;
+    switch (rng() % 10) {
+    case 0: // out of the range of the calendar or not a date at all
+      snprintf(buf, sizeof(buf), "%04ld%02ld%02ld", rng() % 2 ? 0 : y, rng() % 14, rng() % 40);
+      break;
+    case 1:
+      snprintf(buf, sizeof(buf), "%s", rng() % 2 ? "UNKNOWN" : " 2023 5 7");
+      break;
+    case 2: // DT with year or month precision
+      snprintf(buf, sizeof(buf), rng() % 2 ? "%04ld" : "%04ld%02ld", y, m);
+      break;
+    default:
+      snprintf(buf, sizeof(buf), "%04ld%02ld%02ld%s", y, m, d, times[rng() % (sizeof(times) / sizeof(times[0]))]);
+      break;
+    }
+    values[i].text = buf;
+    values[i].datetime = rng() % 2;
+  }
+  return values;
+}
+
+struct Result {
+  size_t mismatches = 0;
+  double oldSeconds = 0;
+  double newSeconds = 0;
+  size_t check = 0;
+};
+
+static void shiftValues(size_t n, unsigned seed, Result &r) {
+  std::vector<Value> values = makeValues(n, seed);
+  int nd = (int)(seed * 7919 % 80001) - 40000;
+  std::vector<std::string> byOld(n);
+  std::vector<char> okOld(n);
+
+  auto t0 = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < n; i++)
+    okOld[i] = values[i].datetime ? old::incrementdatetime(values[i].text, nd, byOld[i]) : old::incrementdate(values[i].text, nd, byOld[i]);
+  auto t1 = std::chrono::steady_clock::now();
+  DateShifter dates(nd);
+  for (size_t i = 0; i < n; i++) {
+    bool ok;
+    std::string_view v = values[i].datetime ? dates.shiftDateTime(values[i].text, ok) : dates.shiftDate(values[i].text, ok);
+    if (ok != (okOld[i] != 0) || (ok && v != byOld[i]))
+      r.mismatches++;
+    r.check += v.size();
+  }
+  auto t2 = std::chrono::steady_clock::now();
+  r.oldSeconds = std::chrono::duration<double>(t1 - t0).count();
+  r.newSeconds = std::chrono::duration<double>(t2 - t1).count();
+}
+
+// day numbers of gday from the first to the last day, compared with the days of std::chrono
+static size_t convertDays(long first, long last) {
+  const long epoch = gday({1970, 1, 1});
+  size_t mismatches = 0;
+  for (long g = first; g <= last; g++) {
+    sdate d = dtf(g);
+    std::chrono::year_month_day ymd{std::chrono::sys_days{std::chrono::days{g - epoch}}};
+    if (d.y != static_cast<int>(ymd.year()) || d.m != (long)static_cast<unsigned>(ymd.month()) || d.d != (long)static_cast<unsigned>(ymd.day()) ||
+        gday(d) != g || !legald(d))
+      mismatches++;
+  }
+  return mismatches;
+}
+
+int main(int argc, char **argv) {
+  size_t n = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+  unsigned nthreads = argc > 2 ? (unsigned)strtoul(argv[2], NULL, 10) : std::max(2u, std::thread::hardware_concurrency());
+
+  const long first = gday({1, 1, 1}), last = gday({9999, 12, 31});
+  long perThread = (last - first + nthreads) / nthreads;
+  std::vector<Result> results(nthreads);
+  std::atomic<size_t> dayMismatches{0};
+  std::vector<std::thread> threads;
+  auto t0 = std::chrono::steady_clock::now();
+  for (unsigned i = 0; i < nthreads; i++)
+    threads.emplace_back([&, i] {
+      shiftValues(n, i + 1, results[i]);
+      dayMismatches += convertDays(first + i * perThread, std::min(last, first + (i + 1) * perThread - 1));
+    });
+  for (std::thread &t : threads)
+    t.join();
+  auto t1 = std::chrono::steady_clock::now();
+
+  Result total;
+  for (const Result &r : results) {
+    total.mismatches += r.mismatches;
+    total.oldSeconds += r.oldSeconds;
+    total.newSeconds += r.newSeconds;
+    total.check += r.check;
+  }
+  fprintf(stdout, "%zu values on %u threads, %ld days (%zu) in %.2f s\n", n * nthreads, nthreads, last - first + 1, total.check,
+          std::chrono::duration<double>(t1 - t0).count());
+  fprintf(stdout, "sscanf + std::chrono: %8.2f M values/s per thread\n", n * nthreads / total.oldSeconds / 1e6);
+  fprintf(stdout, "DateShifter:          %8.2f M values/s per thread\n", n * nthreads / total.newSeconds / 1e6);
+  if (total.mismatches > 0)
+    fprintf(stderr, "Error: %zu values are shifted differently than by the old code.\n", total.mismatches);
+  if (dayMismatches > 0)
+    fprintf(stderr, "Error: %zu days differ from std::chrono.\n", (size_t)dayMismatches);
+  return total.mismatches == 0 && dayMismatches == 0 ? 0 : 1;
+}
@@ -0,0 +1,215 @@
+// Micro benchmark of the memory mapped input (MappedInput in fileio.h) against letting gdcm
+// open the file (Reader::SetFileName, an std::ifstream) like anonymize does without --mmap.
+// Every file is parsed completely both ways and the data sets have to be the same. Each
+// round is run with the files in the page cache and after dropping them from it with
+// posix_fadvise(DONTNEED), the second one shows the cost of reading from the disk.
+//
+// Without file arguments a set of small CT like files (explicit VR little endian, 512x512 16
+// bit pixel data) is written to a temporary directory and removed at the end.
+//
+//   benchmark_mmap [rounds] [DICOM files...]
+
+#include "fileio.h"
+
+#include "gdcmDataElement.h"
+#include "gdcmDataSet.h"
+#include "gdcmReader.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+static void put16(std::string &out, uint16_t v) {
+  out += (char)(v & 0xff);
+  out += (char)(v >> 8);
+}
+
+static void put32(std::string &out, uint32_t v) {
+  put16(out, (uint16_t)(v & 0xffff));
+  put16(out, (uint16_t)(v >> 16));
+}
+
+// explicit VR little endian element, values are padded to an even length
+static void element(std::string &out, uint16_t group, uint16_t elem, const char *vr, std::string value) {
+  if (value.size() % 2)
+    value += vr[0] == 'U' && vr[1] == 'I' ? '\0' : ' ';
+  put16(out, group);
+  put16(out, elem);
+  out.append(vr, 2);
+  std::string v(vr);
+  if (v == "OB" || v == "OW" || v == "SQ" || v == "UN" || v == "UT") {
+    put16(out, 0);
+    put32(out, (uint32_t)value.size());
+  } else {
+    put16(out, (uint16_t)value.size());
+  }
+  out += value;
+}
+
+static std::string us(uint16_t v) {
+  std::string s;
+  put16(s, v);
+  return s;
+}
+
+static bool writeTestFile(const std::string &filename, int i) {
+  const std::string sopClass = "1.2.840.10008.5.1.4.1.1.2";
+  const std::string sopInstance = "1.2.826.0.1.3680043.2.1125.1." + std::to_string(i);
+  const std::string ts = "1.2.840.10008.1.2.1";
+
+  std::string meta;
+  element(meta, 0x0002, 0x0001, "OB", std::string("\0\1", 2));
+  element(meta, 0x0002, 0x0002, "UI", sopClass);
+  element(meta, 0x0002, 0x0003, "UI", sopInstance);
+  element(meta, 0x0002, 0x0010, "UI", ts);
+  std::string groupLength;
+  put32(groupLength, (uint32_t)meta.size());
+
+  std::string out(128, '\0');
+  out += "DICM";
+  element(out, 0x0002, 0x0000, "UL", groupLength);
+  out += meta;
+  element(out, 0x0008, 0x0016, "UI", sopClass);
+  element(out, 0x0008, 0x0018, "UI", sopInstance);
+  element(out, 0x0008, 0x0020, "DA", "20240229");
+  element(out, 0x0008, 0x0060, "CS", "CT");
+  element(out, 0x0008, 0x103e, "LO", "BENCHMARK SERIES");
+  element(out, 0x0010, 0x0010, "PN", "DOE^JOHN");
+  element(out, 0x0010, 0x0020, "LO", "PATIENT" + std::to_string(i % 10));
+  element(out, 0x0020, 0x000d, "UI", "1.2.826.0.1.3680043.2.1125.2." + std::to_string(i % 10));
+  element(out, 0x0020, 0x000e, "UI", "1.2.826.0.1.3680043.2.1125.3." + std::to_string(i % 10));
+  element(out, 0x0020, 0x0013, "IS", std::to_string(i));
+  element(out, 0x0028, 0x0002, "US", us(1));
+  element(out, 0x0028, 0x0004, "CS", "MONOCHROME2");
+  element(out, 0x0028, 0x0010, "US", us(512));
+  element(out, 0x0028, 0x0011, "US", us(512));
+  element(out, 0x0028, 0x0100, "US", us(16));
+  element(out, 0x0028, 0x0101, "US", us(12));
+  element(out, 0x0028, 0x0102, "US", us(11));
+  element(out, 0x0028, 0x0103, "US", us(0));
+  std::string pixels(512 * 512 * 2, '\0');
+  for (size_t p = 0; p < pixels.size(); p++)
+    pixels[p] = (char)((p * 31 + i) & 0x0f);
+  element(out, 0x7fe0, 0x0010, "OW", pixels);
+
+  FILE *f = fopen(filename.c_str(), "wb");
+  if (!f)
+    return false;
+  bool ok = fwrite(out.data(), 1, out.size(), f) == out.size();
+  return fclose(f) == 0 && ok;
+}
+
+static void dropFromCache(const std::vector<std::string> &files) {
+  for (const std::string &name : files) {
+    int fd = open(name.c_str(), O_RDONLY);
+    if (fd < 0)
+      continue;
+#ifdef POSIX_FADV_DONTNEED
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+    close(fd);
+  }
+}
+
+// tags and values of all elements of the top level data set
+static std::string summary(const gdcm::DataSet &ds) {
+  std::string s;
+  for (gdcm::DataSet::ConstIterator it = ds.Begin(); it != ds.End(); ++it) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%04x%04x:%u:", it->GetTag().GetGroup(), it->GetTag().GetElement(), (unsigned)it->GetVL());
+    s += buf;
+    if (const gdcm::ByteValue *bv = it->GetByteValue())
+      s.append(bv->GetPointer(), bv->GetLength());
+  }
+  return s;
+}
+
+// parse all files, with mapped set through MappedInput, returns the seconds
+static double parseAll(const std::vector<std::string> &files, MappedInput *mapped, std::vector<std::string> *summaries, size_t &failed) {
+  auto t0 = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < files.size(); i++) {
+    gdcm::Reader reader;
+    if (mapped) {
+      if (!mapped->open(files[i].c_str(), false)) {
+        failed++;
+        continue;
+      }
+      reader.SetStream(mapped->stream());
+    } else {
+      reader.SetFileName(files[i].c_str());
+    }
+    if (!reader.Read())
+      failed++;
+    else if (summaries)
+      (*summaries)[i] = summary(reader.GetFile().GetDataSet());
+    if (mapped)
+      mapped->close();
+  }
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+}
+
+int main(int argc, char **argv) {
+  int rounds = argc > 1 ? atoi(argv[1]) : 5;
+  if (rounds < 1)
+    rounds = 1;
+
+  std::vector<std::string> files;
+  std::string tmpdir;
+  for (int i = 2; i < argc; i++)
+    files.push_back(argv[i]);
+  if (files.empty()) {
+    char dirname[] = "/tmp/benchmark_mmap_XXXXXX";
+    if (!mkdtemp(dirname)) {
+      fprintf(stderr, "Error: could not create a temporary directory.\n");
+      return 1;
+    }
+    tmpdir = dirname;
+    for (int i = 0; i < 200; i++) {
+      files.push_back(tmpdir + "/" + std::to_string(i) + ".dcm");
+      if (!writeTestFile(files.back(), i)) {
+        fprintf(stderr, "Error: could not write \"%s\".\n", files.back().c_str());
+        return 1;
+      }
+    }
+  }
+
+  // both have to see the same data sets
+  size_t failed = 0, mismatches = 0;
+  MappedInput mapped;
+  std::vector<std::string> byStream(files.size()), byMapping(files.size());
+  parseAll(files, NULL, &byStream, failed);
+  parseAll(files, &mapped, &byMapping, failed);
+  for (size_t i = 0; i < files.size(); i++)
+    if (byStream[i] != byMapping[i])
+      mismatches++;
+
+  double cached[2] = {0, 0}, uncached[2] = {0, 0};
+  for (int r = 0; r < rounds; r++) {
+    cached[0] += parseAll(files, NULL, NULL, failed);
+    cached[1] += parseAll(files, &mapped, NULL, failed);
+    dropFromCache(files);
+    uncached[0] += parseAll(files, NULL, NULL, failed);
+    dropFromCache(files);
+    uncached[1] += parseAll(files, &mapped, NULL, failed);
+  }
+
+  if (!tmpdir.empty()) {
+    for (const std::string &name : files)
+      unlink(name.c_str());
+    rmdir(tmpdir.c_str());
+  }
+
+  double n = (double)files.size() * rounds;
+  fprintf(stdout, "%zu files, %d rounds\n", files.size(), rounds);
+  fprintf(stdout, "                     page cache    not cached\n");
+  fprintf(stdout, "SetFileName:        %8.1f us   %8.1f us per file\n", cached[0] / n * 1e6, uncached[0] / n * 1e6);
+  fprintf(stdout, "MappedInput:        %8.1f us   %8.1f us per file\n", cached[1] / n * 1e6, uncached[1] / n * 1e6);
+  if (failed > 0)
+    fprintf(stderr, "Error: %zu files could not be read.\n", failed);
+  if (mismatches > 0)
+    fprintf(stderr, "Error: %zu files have a different data set when they are read from the mapping.\n", mismatches);
+  return failed == 0 && mismatches == 0 ? 0 : 1;
+}
@@ -0,0 +1,132 @@
+// Micro benchmark of the read ahead (ReadAhead in fileio.h, --prefetch) for a single worker.
+// The worker reads each file completely and then works on it for a fixed time (a busy loop
+// that stands in for parsing and anonymizing), once without read ahead and once announcing
+// the next files before every file like ReadFilesThread does. The files are dropped from the
+// page cache before each run. Both runs have to read the same bytes.
+//
+// On a local disk the difference is small. readahead_throttled.sh runs it on a loop device
+// whose read bandwidth is throttled like a slow network mount.
+//
+// Without file arguments 200 files of 512 KB are written to a temporary directory and removed
+// at the end.
+//
+//   benchmark_readahead [work us per file] [prefetch files] [files...]
+
+#include "fileio.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+static void dropFromCache(const std::vector<std::string> &files) {
+  for (const std::string &name : files) {
+    int fd = open(name.c_str(), O_RDONLY);
+    if (fd < 0)
+      continue;
+#ifdef POSIX_FADV_DONTNEED
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+    close(fd);
+  }
+}
+
+// read the file completely, returns a checksum of its bytes
+static uint64_t readFile(const std::string &name, std::vector<char> &buf, uintmax_t &bytes) {
+  int fd = open(name.c_str(), O_RDONLY);
+  if (fd < 0)
+    return 0;
+  uint64_t sum = 0;
+  ssize_t n;
+  while ((n = read(fd, buf.data(), buf.size())) > 0) {
+    for (ssize_t i = 0; i < n; i += 64)
+      sum = sum * 31 + (unsigned char)buf[i];
+    bytes += (uintmax_t)n;
+  }
+  close(fd);
+  return sum;
+}
+
+static void work(long us) {
+  auto end = std::chrono::steady_clock::now() + std::chrono::microseconds(us);
+  while (std::chrono::steady_clock::now() < end) {
+  }
+}
+
+struct Run {
+  double seconds = 0;
+  uintmax_t bytes = 0;
+  uint64_t checksum = 0;
+};
+
+static Run runWorker(const std::vector<std::string> &files, long workus, size_t prefetch) {
+  dropFromCache(files);
+  Run r;
+  std::vector<char> buf(1 << 20);
+  ReadAhead readahead(prefetch, 64 << 20);
+  auto t0 = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < files.size(); i++) {
+    if (prefetch > 0) {
+      std::vector<const char *> upcoming;
+      for (size_t j = i + 1; j < files.size() && j <= i + prefetch; j++)
+        upcoming.push_back(files[j].c_str());
+      readahead.update(upcoming);
+    }
+    r.checksum = r.checksum * 1000003 + readFile(files[i], buf, r.bytes);
+    work(workus);
+  }
+  r.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+  return r;
+}
+
+int main(int argc, char **argv) {
+  long workus = argc > 1 ? atol(argv[1]) : 2000;
+  size_t prefetch = argc > 2 ? strtoul(argv[2], NULL, 10) : 8;
+
+  std::vector<std::string> files;
+  std::string tmpdir;
+  for (int i = 3; i < argc; i++)
+    files.push_back(argv[i]);
+  if (files.empty()) {
+    char dirname[] = "/tmp/benchmark_readahead_XXXXXX";
+    if (!mkdtemp(dirname)) {
+      fprintf(stderr, "Error: could not create a temporary directory.\n");
+      return 1;
+    }
+    tmpdir = dirname;
+    std::string content(512 << 10, '\0');
+    for (int i = 0; i < 200; i++) {
+      for (size_t p = 0; p < content.size(); p++)
+        content[p] = (char)(p * 131 + i);
+      files.push_back(tmpdir + "/" + std::to_string(i) + ".dcm");
+      FILE *f = fopen(files.back().c_str(), "wb");
+      bool ok = f && fwrite(content.data(), 1, content.size(), f) == content.size();
+      if (!f || fclose(f) != 0 || !ok) {
+        fprintf(stderr, "Error: could not write \"%s\".\n", files.back().c_str());
+        return 1;
+      }
+    }
+  }
+
+  Run plain = runWorker(files, workus, 0);
+  Run ahead = runWorker(files, workus, prefetch);
+
+  if (!tmpdir.empty()) {
+    for (const std::string &name : files)
+      unlink(name.c_str());
+    rmdir(tmpdir.c_str());
+  }
+
+  fprintf(stdout, "%zu files, %.1f MB, %ld us work per file\n", files.size(), plain.bytes / 1e6, workus);
+  fprintf(stdout, "no read ahead:        %8.2f s  %8.1f MB/s  %8.1f files/s\n", plain.seconds, plain.bytes / plain.seconds / 1e6,
+          files.size() / plain.seconds);
+  fprintf(stdout, "read ahead %3zu files: %8.2f s  %8.1f MB/s  %8.1f files/s\n", prefetch, ahead.seconds, ahead.bytes / ahead.seconds / 1e6,
+          files.size() / ahead.seconds);
+  if (plain.bytes != ahead.bytes || plain.checksum != ahead.checksum) {
+    fprintf(stderr, "Error: the runs with and without read ahead read different data.\n");
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,104 @@
+// Micro benchmark of setValue (elementvalue.h) against copying the element out of the DataSet,
+// setting a new ByteValue and putting it back with DataSet::Replace like applyWork did before.
+// Counts the heap allocations of both, checks that they produce the same values and that a
+// copy of an element that shares its ByteValue keeps the old value.
+//
+//   benchmark_setvalue [elements] [rounds]
+
+#include "elementvalue.h"
+
+#include "gdcmDataElement.h"
+#include "gdcmDataSet.h"
+#include "gdcmTag.h"
+#include "gdcmVR.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <vector>
+
+static std::atomic<size_t> allocations{0};
+
+void *operator new(size_t n) {
+  allocations++;
+  if (void *p = malloc(n ? n : 1))
+    return p;
+  throw std::bad_alloc();
+}
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+static void fill(gdcm::DataSet &ds, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    gdcm::DataElement de(gdcm::Tag(0x0009, (uint16_t)(0x1000 + i)));
+    de.SetVR(gdcm::VR::LO);
+    std::string v = "ORIGINAL VALUE " + std::to_string(i);
+    de.SetByteValue(v.c_str(), (uint32_t)v.size());
+    ds.Insert(de);
+  }
+}
+
+static std::string valueOf(const gdcm::DataElement &de) {
+  const gdcm::ByteValue *bv = de.GetByteValue();
+  return bv ? std::string(bv->GetPointer(), bv->GetLength()) : std::string();
+}
+
+int main(int argc, char **argv) {
+  size_t n = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000;
+  size_t rounds = argc > 2 ? strtoul(argv[2], NULL, 10) : 100;
+  const std::string values[2] = {"ANONYMIZED", "1.3.6.1.4.1.45037.0123456789"};
+
+  gdcm::DataSet replaced, inplace;
+  fill(replaced, n);
+  fill(inplace, n);
+  std::vector<gdcm::Tag> tags;
+  for (gdcm::DataSet::ConstIterator it = replaced.Begin(); it != replaced.End(); ++it)
+    tags.push_back(it->GetTag());
+
+  size_t a0 = allocations;
+  auto t0 = std::chrono::steady_clock::now();
+  for (size_t r = 0; r < rounds; r++) {
+    const std::string &v = values[r % 2];
+    for (const gdcm::Tag &tag : tags) { // Replace invalidates the iterators of the set
+      gdcm::DataElement copy = replaced.GetDataElement(tag);
+      copy.SetByteValue(v.c_str(), (uint32_t)v.size());
+      replaced.Replace(copy);
+    }
+  }
+  auto t1 = std::chrono::steady_clock::now();
+  size_t a1 = allocations;
+  for (size_t r = 0; r < rounds; r++) {
+    const std::string &v = values[r % 2];
+    for (gdcm::DataSet::Iterator it = inplace.Begin(); it != inplace.End(); ++it)
+      setValue(*it, v.c_str(), (uint32_t)v.size());
+  }
+  auto t2 = std::chrono::steady_clock::now();
+  size_t a2 = allocations;
+
+  size_t mismatches = 0;
+  for (gdcm::DataSet::ConstIterator a = replaced.Begin(), b = inplace.Begin(); a != replaced.End() && b != inplace.End(); ++a, ++b)
+    if (valueOf(*a) != valueOf(*b) || a->GetVL() != b->GetVL())
+      mismatches++;
+
+  // an element that shares its value with a copy gets a new ByteValue, the copy is not changed
+  const gdcm::DataElement &first = *inplace.Begin();
+  gdcm::DataElement copy = first;
+  std::string before = valueOf(copy);
+  setValue(first, "SHARED", 6);
+  bool sharedOk = valueOf(copy) == before && valueOf(first) == "SHARED";
+
+  double ops = (double)n * rounds;
+  fprintf(stdout, "%zu elements, %zu rounds\n", n, rounds);
+  fprintf(stdout, "copy + Replace: %8.1f ns, %5.2f allocations per value\n", std::chrono::duration<double, std::nano>(t1 - t0).count() / ops,
+          (a1 - a0) / ops);
+  fprintf(stdout, "setValue:       %8.1f ns, %5.2f allocations per value\n", std::chrono::duration<double, std::nano>(t2 - t1).count() / ops,
+          (a2 - a1) / ops);
+  if (mismatches > 0)
+    fprintf(stderr, "Error: %zu elements have a different value.\n", mismatches);
+  if (!sharedOk)
+    fprintf(stderr, "Error: the copy of an element changed with it.\n");
+  return mismatches == 0 && sharedOk ? 0 : 1;
+}
@@ -0,0 +1,89 @@
+// Micro benchmark of the batched SHA-256 (SHA-256-multi.hpp) over UIDs of 64 to 100 bytes,
+// the length of the UIDs in the files (one or two blocks after padding). Every implementation
+// the CPU supports (scalar, SHA-NI, AVX2 x8, AVX-512 x16) hashes the same UIDs in batches like
+// AnonContext does for a file, each digest has to be the same as SHA256::digestString.
+//
+//   benchmark_sha256 [uids] [batch]
+
+#include "SHA-256-multi.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+static bool supported(SHA256Multi::Implementation impl) {
+#ifdef SHA256_MULTI_X86
+  __builtin_cpu_init();
+  switch (impl) {
+  case SHA256Multi::SHANI: return SHA256Multi::cpuHasShaNi();
+  case SHA256Multi::AVX512: return __builtin_cpu_supports("avx512f");
+  case SHA256Multi::AVX2: return __builtin_cpu_supports("avx2");
+  default: return true;
+  }
+#else
+  return impl == SHA256Multi::SCALAR;
+#endif
+}
+
+int main(int argc, char **argv) {
+  size_t n = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+  size_t batch = argc > 2 ? strtoul(argv[2], NULL, 10) : 64;
+  if (batch == 0)
+    batch = 1;
+
+  // organizational root, then digits and dots up to 64 to 100 bytes
+  std::mt19937 rng(42);
+  std::vector<std::string> uids(n);
+  for (size_t i = 0; i < n; i++) {
+    std::string uid = "1.2.840.113619.2.55.3." + std::to_string(i);
+    size_t length = 64 + rng() % 37;
+    while (uid.size() < length)
+      uid += (uid.back() != '.' && rng() % 8 == 0 && uid.size() + 1 < length) ? '.' : (char)('1' + rng() % 9);
+    uids[i] = uid;
+  }
+
+  size_t check = 0; // uses the first byte so the loops are not optimized away
+  auto t0 = std::chrono::steady_clock::now();
+  std::vector<SHA256::digest> expected(n);
+  for (size_t i = 0; i < n; i++) {
+    expected[i] = SHA256::digestString(uids[i]);
+    check += expected[i].data[0];
+  }
+  auto t1 = std::chrono::steady_clock::now();
+  fprintf(stdout, "%zu uids of 64 to 100 bytes, batches of %zu, selected: %s\n", n, batch, SHA256Multi::implementationName());
+  fprintf(stdout, "SHA256::digestString: %8.2f M digests/s\n", n / std::chrono::duration<double>(t1 - t0).count() / 1e6);
+
+  size_t mismatches = 0;
+  const SHA256Multi::Implementation all[] = {SHA256Multi::SCALAR, SHA256Multi::SHANI, SHA256Multi::AVX2, SHA256Multi::AVX512};
+  const SHA256Multi::Implementation selected = SHA256Multi::implementation();
+  std::vector<SHA256::digest> out(n);
+  for (SHA256Multi::Implementation impl : all) {
+    SHA256Multi::implementation() = impl;
+    const char *name = SHA256Multi::implementationName();
+    if (!supported(impl)) {
+      fprintf(stdout, "%-20s  not supported by this CPU\n", name);
+      continue;
+    }
+    auto t2 = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < n; i += batch)
+      SHA256Multi::digestMany(&uids[i], std::min(batch, n - i), &out[i]);
+    auto t3 = std::chrono::steady_clock::now();
+    size_t wrong = 0;
+    for (size_t i = 0; i < n; i++) {
+      check += out[i].data[0];
+      if (!(out[i] == expected[i]))
+        wrong++;
+    }
+    fprintf(stdout, "%-20s: %8.2f M digests/s\n", name, n / std::chrono::duration<double>(t3 - t2).count() / 1e6);
+    if (wrong > 0)
+      fprintf(stderr, "Error: %zu digests of %s differ from SHA256::digestString.\n", wrong, name);
+    mismatches += wrong;
+  }
+  SHA256Multi::implementation() = selected;
+  fprintf(stdout, "(%zu)\n", check);
+  return mismatches == 0 ? 0 : 1;
+}
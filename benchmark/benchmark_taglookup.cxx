@@ -0,0 +1,84 @@
+// Micro benchmark of the rule lookup (TagLookup) against the formatted string key in a std::map
+// that AnonymizeBasedOnWork used before. Both have to return the same rule for every tag.
+//
+//   benchmark_taglookup [elements]
+
+#include "taglookup.h"
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+int main(int argc, char **argv) {
+  size_t n = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+
+  // about as many rules as the build-in ones, in the groups they use (and one private group)
+  const uint16_t groups[] = {0x0008, 0x0010, 0x0012, 0x0013, 0x0018, 0x0020, 0x0028, 0x0032, 0x0038, 0x0040, 0x0070, 0x0088, 0x300a};
+  std::mt19937 rng(42);
+  std::vector<uint32_t> ruleTags;
+  for (int i = 0; i < 279; i++)
+    ruleTags.push_back((uint32_t)groups[rng() % (sizeof(groups) / sizeof(groups[0]))] << 16 | (rng() % 0x2000));
+
+  std::map<std::string, int> workCache;
+  TagLookup lookup;
+  char buf1[16], buf2[16];
+  for (size_t i = 0; i < ruleTags.size(); i++) {
+    snprintf(buf1, 16, "%04x", ruleTags[i] >> 16);
+    snprintf(buf2, 16, "%04x", ruleTags[i] & 0xffff);
+    workCache.insert(std::make_pair(std::string(buf1) + std::string(buf2), (int)i)); // the first rule for a tag wins
+    lookup.add(ruleTags[i], (int)i);
+  }
+  lookup.finalize();
+
+  // 20% of the elements have a rule, the others are from the same or from other groups
+  std::vector<uint32_t> elements(n);
+  for (size_t i = 0; i < n; i++) {
+    if (rng() % 5 == 0)
+      elements[i] = ruleTags[rng() % ruleTags.size()];
+    else if (rng() % 2 == 0)
+      elements[i] = (uint32_t)groups[rng() % (sizeof(groups) / sizeof(groups[0]))] << 16 | (rng() % 0x10000);
+    else
+      elements[i] = rng();
+  }
+
+  auto t0 = std::chrono::steady_clock::now();
+  long sumMap = 0;
+  std::vector<int> byMap(n);
+  for (size_t i = 0; i < n; i++) {
+    snprintf(buf1, 16, "%04x", elements[i] >> 16);
+    snprintf(buf2, 16, "%04x", elements[i] & 0xffff);
+    std::string key = std::string(buf1) + std::string(buf2);
+    auto it = workCache.find(key);
+    byMap[i] = it == workCache.end() ? -1 : it->second;
+    sumMap += byMap[i];
+  }
+  auto t1 = std::chrono::steady_clock::now();
+  long sumLookup = 0;
+  std::vector<int> byLookup(n);
+  for (size_t i = 0; i < n; i++) {
+    byLookup[i] = lookup.find(elements[i]);
+    sumLookup += byLookup[i];
+  }
+  auto t2 = std::chrono::steady_clock::now();
+
+  size_t mismatches = 0;
+  for (size_t i = 0; i < n; i++)
+    if (byMap[i] != byLookup[i])
+      mismatches++;
+
+  double mapNs = std::chrono::duration<double, std::nano>(t1 - t0).count() / n;
+  double lookupNs = std::chrono::duration<double, std::nano>(t2 - t1).count() / n;
+  fprintf(stdout, "%zu elements, %zu rules\n", n, ruleTags.size());
+  fprintf(stdout, "string key + std::map: %8.1f ns per element (%ld)\n", mapNs, sumMap);
+  fprintf(stdout, "TagLookup:             %8.1f ns per element (%ld)\n", lookupNs, sumLookup);
+  if (mismatches > 0) {
+    fprintf(stderr, "Error: %zu elements got a different rule.\n", mismatches);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,76 @@
+// Micro benchmark of the UID formatting (uidformat.h) against the string based betterUID and
+// toDec that anonymize used before. The digests are computed once up front, only the formatting
+// is measured. Every UID (with and without prefix, decimal and old style hexadecimal) has to be
+// the same as the one of the old code.
+//
+//   benchmark_uid [uids]
+
+#include "uidformat.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+// the code before formatUID
+namespace old {
+std::string toDec(SHA256::Byte *data, int size) {
+  std::string ret = "";
+  const char *decdigit = "0123456789012345";
+  for (int i = 0; i < size; i++) {
+    ret += decdigit[(data[i] >> 4) & 0xf]; // high 4 bits
+    ret += decdigit[(data[i]) & 0xf];      // low 4 bits
+  }
+  return ret;
+}
+
+std::string hash(SHA256::digest a, bool old_style_uid) { return old_style_uid ? a.toHex() : toDec(a.data, a.size); }
+
+std::string betterUID(SHA256::digest a, bool old_style_uid) {
+  std::string prefix = "1.3.6.1.4.1.45037"; // organizational prefix for us
+  std::string phash = prefix + "." + hash(a, old_style_uid);
+  return phash.substr(0, 63);
+}
+} // namespace old
+
+int main(int argc, char **argv) {
+  size_t n = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+
+  std::vector<SHA256::digest> digests(n);
+  for (size_t i = 0; i < n; i++)
+    digests[i] = SHA256::digestString("1.2.840.113619.2.55.3." + std::to_string(i));
+
+  size_t mismatches = 0;
+  for (size_t i = 0; i < n; i++) {
+    for (bool old_style_uid : {false, true}) {
+      UIDBuffer buf;
+      if (formatUID(digests[i], old_style_uid, true, buf) != old::betterUID(digests[i], old_style_uid))
+        mismatches++;
+      if (formatUID(digests[i], old_style_uid, false, buf) != old::hash(digests[i], old_style_uid))
+        mismatches++;
+    }
+  }
+
+  size_t check = 0; // uses the last digit so the loops are not optimized away
+  auto t0 = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < n; i++)
+    check += old::betterUID(digests[i], false).back();
+  auto t1 = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < n; i++) {
+    UIDBuffer buf;
+    check += formatUID(digests[i], false, true, buf).back();
+  }
+  auto t2 = std::chrono::steady_clock::now();
+
+  double oldSeconds = std::chrono::duration<double>(t1 - t0).count();
+  double newSeconds = std::chrono::duration<double>(t2 - t1).count();
+  fprintf(stdout, "%zu uids (%zu)\n", n, check);
+  fprintf(stdout, "betterUID (std::string): %8.2f M uids/s\n", n / oldSeconds / 1e6);
+  fprintf(stdout, "formatUID (UIDBuffer):   %8.2f M uids/s\n", n / newSeconds / 1e6);
+  if (mismatches > 0) {
+    fprintf(stderr, "Error: %zu uids differ from the old betterUID.\n", mismatches);
+    return 1;
+  }
+  return 0;
+}
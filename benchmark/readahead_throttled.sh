@@ -0,0 +1,69 @@
+#!/bin/sh
+# Run benchmark_readahead on a local mount that is throttled like network storage.
+#
+# An ext4 image on a loop device is filled with 200 files of 512 KB. The benchmark runs in a
+# cgroup that limits the reads from the loop device to MB/s and I/O operations per second
+# (io.max with cgroup v2, blkio.throttle with cgroup v1). Needs root, losetup and mkfs.ext4.
+#
+# The throttle limits the bandwidth and the operations per second, not the latency of a single
+# read: while the worker is busy with a file the budget for the next reads builds up. This
+# shows the effect of read ahead on a slow link, not on storage with a high latency per access
+# (that would need a delay device, e.g. dm-delay).
+#
+#   readahead_throttled.sh <benchmark_readahead> [MB/s] [iops] [work us per file] [prefetch files]
+set -e
+
+bench=$1
+mbps=${2:-50}
+iops=${3:-200}
+workus=${4:-2000}
+prefetch=${5:-8}
+if [ -z "$bench" ] || [ ! -x "$bench" ]; then
+  echo "usage: $0 <benchmark_readahead> [MB/s] [iops] [work us per file] [prefetch files]" >&2
+  exit 2
+fi
+if [ "$(id -u)" -ne 0 ]; then
+  echo "Error: needs root for the loop device and the cgroup." >&2
+  exit 2
+fi
+
+img=$(mktemp /tmp/readahead_throttled.XXXXXX)
+mnt=$(mktemp -d /tmp/readahead_throttled_mnt.XXXXXX)
+loop=
+cgroup=
+cleanup() {
+  [ -n "$cgroup" ] && rmdir "$cgroup" 2>/dev/null
+  mountpoint -q "$mnt" && umount "$mnt"
+  [ -n "$loop" ] && losetup -d "$loop"
+  rmdir "$mnt"
+  rm -f "$img"
+}
+trap cleanup EXIT
+
+truncate -s 256M "$img"
+mkfs.ext4 -q -F "$img"
+loop=$(losetup -f --show "$img")
+mount "$loop" "$mnt"
+i=0
+while [ $i -lt 200 ]; do
+  head -c 524288 /dev/urandom > "$mnt/$(printf %03d $i).dcm"
+  i=$((i + 1))
+done
+sync
+
+device=$(printf '%d:%d' "0x$(stat -c %t "$loop")" "0x$(stat -c %T "$loop")")
+bps=$((mbps * 1024 * 1024))
+if [ -f /sys/fs/cgroup/cgroup.controllers ]; then
+  grep -qw io /sys/fs/cgroup/cgroup.subtree_control || echo +io > /sys/fs/cgroup/cgroup.subtree_control
+  cgroup=/sys/fs/cgroup/readahead_throttled.$$
+  mkdir "$cgroup"
+  echo "$device rbps=$bps riops=$iops" > "$cgroup/io.max"
+else
+  cgroup=/sys/fs/cgroup/blkio/readahead_throttled.$$
+  mkdir "$cgroup"
+  echo "$device $bps" > "$cgroup/blkio.throttle.read_bps_device"
+  echo "$device $iops" > "$cgroup/blkio.throttle.read_iops_device"
+fi
+
+echo "loop device $loop ($device) throttled to $mbps MB/s and $iops reads/s"
+sh -c 'echo $$ > "$1/cgroup.procs"; shift; exec "$@"' sh "$cgroup" "$bench" "$workus" "$prefetch" "$mnt"/*.dcm
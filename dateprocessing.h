@@ -1,65 +1,99 @@
 #ifndef INCLUDE_DATEPROCESSING_HPP_
 #define INCLUDE_DATEPROCESSING_HPP_
 
-#include <sys/time.h>
+// Date arithmetic for the DA and DT values of DICOM, used by DateShifter (dateshift.h).
+//
+// Dates are converted to day numbers (gday) and back (dtf) on the proleptic Gregorian
+// calendar, the conversions are exact from year 1 on. There is no state, all functions are
+// constexpr and can be used from all worker threads at the same time. Invalid values are
+// reported through the return value, nothing is printed and the program is never stopped.
 
 struct sdate {
   long y;
   long m;
   long d;
-  };
+};
 
-struct sdate date1;
-struct sdate date2;
-struct sdate dtest;
-struct timeval now, *pnow;
-struct tm today, *ptoday;
-long offset, g1, g2;
-long calstart;   /* Earliest date on Gregorian calendar */
-long args[6];
-long *i, j;
-char *progname;
-const char warn1[] = "WARNING: Dates before Oct. 1582 are inaccurate.";
+constexpr long gday(sdate d) { /* convert date to day number */
+  long y, m;
 
-long gday(struct sdate d) {       /* convert date to day number */
-  long  y, m;
+  m = (d.m + 9) % 12;    /* mar=0, feb=11 */
+  y = d.y - m / 10;      /* if Jan/Feb, year-- */
+  return y * 365 + y / 4 - y / 100 + y / 400 + (m * 306 + 5) / 10 + (d.d - 1);
+}
 
-  m = (d.m + 9)%12;                /* mar=0, feb=11 */
-  y = d.y - m/10;                     /* if Jan/Feb, year-- */
-  return y*365 + y/4 - y/100 + y/400 + (m*306 + 5)/10 + (d.d - 1);
-  }
-
-struct sdate dtf(long d) { /* convert day number to y,m,d format */
-  struct sdate pd;
-  long y, ddd, mm, dd, mi;
+constexpr sdate dtf(long d) { /* convert day number to y,m,d format */
+  sdate pd = {0, 0, 0};
+  long y, ddd, mi;
 
-  y = (10000*d + 14780)/3652425;
-  ddd = d - (y*365 + y/4 - y/100 + y/400);
+  y = (10000 * d + 14780) / 3652425;
+  ddd = d - (y * 365 + y / 4 - y / 100 + y / 400);
   if (ddd < 0) {
     y--;
-    ddd = d - (y*365 + y/4 - y/100 + y/400);
-    }
-  mi = (52 + 100*ddd)/3060;
-  pd.y = y + (mi + 2)/12;
-  pd.m = (mi + 2)%12 + 1;
-  pd.d = ddd - (mi*306 + 5)/10 + 1;
-  return pd;
+    ddd = d - (y * 365 + y / 4 - y / 100 + y / 400);
   }
+  mi = (52 + 100 * ddd) / 3060;
+  pd.y = y + (mi + 2) / 12;
+  pd.m = (mi + 2) % 12 + 1;
+  pd.d = ddd - (mi * 306 + 5) / 10 + 1;
+  return pd;
+}
 
-long legald(struct sdate d) {   /* return gday, or exit if bad date */
-  struct sdate t;
-  long g;
+// first day of the Gregorian calendar (Oct. 15, 1582), dates before are proleptic
+constexpr long calstart = gday({1582, 10, 15});
 
+// true if d is a date of the calendar (from year 1 on), g is set to its day number
+constexpr bool legald(sdate d, long &g) {
+  if (d.y < 1 || d.m < 1 || d.m > 12 || d.d < 1 || d.d > 31)
+    return false;
   g = gday(d);
-  if (g < calstart) fprintf(stderr,"%s: %s\n", progname, warn1);
-  t = dtf(g);
-  if (d.y == t.y && d.m == t.m && d.d == t.d) {
-    return g;
-    }
-  else {
-    fprintf(stderr,"%s: Illegal date %ld %ld %ld.\n",
-            progname, d.y, d.m, d.d);
-    exit(2);
-    }
-  }
-#endif /* OPTIONPARSER_H_ */
+  sdate t = dtf(g);
+  return d.y == t.y && d.m == t.m && d.d == t.d;
+}
+
+constexpr bool legald(sdate d) {
+  long g = 0;
+  return legald(d, g);
+}
+
+// A DT value with year or month precision (fields: 1 year, 2 month, 3 day) as a date, the
+// missing components count as January and the 1st.
+constexpr sdate completeDate(sdate d, int fields) {
+  if (fields < 3)
+    d.d = 1;
+  if (fields < 2)
+    d.m = 1;
+  return d;
+}
+
+// Add days to a date in the years 1 to 9999 with the day numbers. A day of 0 or past the end
+// of the month rolls over like in std::chrono. Returns false and leaves d unchanged if the
+// date or the result is outside of that range.
+constexpr bool addDays(sdate &d, long days) {
+  if (d.y < 1 || d.y > 9999 || d.m < 1 || d.m > 12 || d.d < 0 || d.d > 99)
+    return false;
+  sdate r = dtf(gday(d) + days);
+  if (r.y < 1 || r.y > 9999)
+    return false;
+  d = r;
+  return true;
+}
+
+static_assert(dtf(gday({2024, 2, 29})).d == 29, "leap day");
+static_assert(gday({2000, 3, 1}) - gday({2000, 2, 28}) == 2, "2000 is a leap year");
+static_assert(gday({1900, 3, 1}) - gday({1900, 2, 28}) == 1, "1900 is not a leap year");
+static_assert(!legald({2023, 2, 29}) && legald({2024, 2, 29}) && !legald({2024, 13, 1}), "legald");
+static_assert([] {
+  sdate d = {2023, 12, 31};
+  return addDays(d, 1) && d.y == 2024 && d.m == 1 && d.d == 1;
+}(), "year change");
+static_assert([] {
+  sdate d = completeDate({2023, 5, 0}, 2);
+  return addDays(d, -1) && d.m == 4 && d.d == 30;
+}(), "month precision");
+static_assert([] {
+  sdate d = {2024, 1, 31}, e = {1, 1, 1}, f = {2024, 13, 1};
+  return addDays(d, 29) && d.m == 2 && d.d == 29 && !addDays(e, -1) && e.y == 1 && !addDays(f, 1);
+}(), "addDays range");
+
+#endif /* INCLUDE_DATEPROCESSING_HPP_ */
@@ -0,0 +1,171 @@
+#ifndef INCLUDE_DATESHIFT_HPP_
+#define INCLUDE_DATESHIFT_HPP_
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include "dateprocessing.h"
+
+// Shifts DA and DT values by the --dateincrement of the run.
+//
+// The values are parsed the way sscanf("%04ld%02ld%02ld") and sscanf("%04ld%02ld%02ld%s")
+// parse them (white space before each field, an optional sign counts towards the width, the
+// first white space ends the %s part) but without the format string interpreter. Dates in
+// the years 1 to 9999 are shifted with addDays (dateprocessing.h), anything else (month 0
+// or 13, negative days, ...) goes through std::chrono like before so the results are the
+// same for all inputs. The dates of a study repeat in every file, the last results are kept
+// in a small memo.
+class DateShifter {
+public:
+  DateShifter(long days = 0) : days(days) {}
+
+  void setDays(long d) {
+    if (d != days)
+      memo.clear();
+    days = d;
+  }
+
+  // DA value (YYYYMMDD). Sets ok to false if the value does not start with a date, the
+  // result is valid until the next call.
+  std::string_view shiftDate(std::string_view value, bool &ok) { return shift(value, false, ok); }
+
+  // DT value (YYYY, YYYYMM, YYYYMMDD or YYYYMMDD followed by the time). Only the date part is
+  // shifted, the rest is kept (padded with a space to an even length).
+  std::string_view shiftDateTime(std::string_view value, bool &ok) { return shift(value, true, ok); }
+
+private:
+  static const size_t maxMemo = 1024;
+
+  std::string_view shift(std::string_view value, bool datetime, bool &ok) {
+    // like c_str() of the old std::string, the value ends at the first NUL
+    size_t nul = value.find('\0');
+    if (nul != std::string_view::npos)
+      value = value.substr(0, nul);
+    key.assign(1, datetime ? 'T' : 'A');
+    key.append(value.data(), value.size());
+    auto it = memo.find(key);
+    if (it != memo.end()) {
+      ok = true;
+      return it->second;
+    }
+    result.clear();
+    ok = datetime ? shiftDT(value) : shiftDA(value);
+    if (!ok)
+      return std::string_view();
+    if (memo.size() >= maxMemo)
+      memo.clear();
+    return memo.emplace(key, result).first->second;
+  }
+
+  bool shiftDA(std::string_view value) {
+    const char *p = value.data(), *end = p + value.size();
+    sdate d;
+    if (!scanLong(p, end, 4, d.y) || !scanLong(p, end, 2, d.m) || !scanLong(p, end, 2, d.d))
+      return false;
+    shiftDays(d);
+    appendField(d.y, 4);
+    appendField(d.m, 2);
+    appendField(d.d, 2);
+    return true;
+  }
+
+  bool shiftDT(std::string_view value) {
+    const char *p = value.data(), *end = p + value.size();
+    sdate d;
+    if (!scanLong(p, end, 4, d.y))
+      return false;
+    int fields = 1;
+    if (scanLong(p, end, 2, d.m)) {
+      fields++;
+      if (scanLong(p, end, 2, d.d))
+        fields++;
+    }
+    d = completeDate(d, fields);
+    shiftDays(d);
+    appendField(d.y, 4);
+    if (fields >= 2)
+      appendField(d.m, 2);
+    if (fields >= 3)
+      appendField(d.d, 2);
+    if (fields == 3) {
+      // %s: the time is the next run of non white space characters
+      while (p < end && isSpace(*p))
+        p++;
+      const char *t = p;
+      while (p < end && !isSpace(*p))
+        p++;
+      if (p > t) {
+        result.append(t, p - t);
+        if ((p - t) % 2 != 0)
+          result += ' ';
+      }
+    }
+    return true;
+  }
+
+  static bool isSpace(char c) { return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r'; }
+
+  // %<width>ld: skip white space, an optional sign and up to width characters in total
+  static bool scanLong(const char *&p, const char *end, int width, long &v) {
+    while (p < end && isSpace(*p))
+      p++;
+    bool negative = false;
+    if (p < end && (*p == '+' || *p == '-')) {
+      negative = *p == '-';
+      p++;
+      width--;
+    }
+    long n = 0;
+    int digits = 0;
+    while (digits < width && p < end && *p >= '0' && *p <= '9') {
+      n = n * 10 + (*p - '0');
+      p++;
+      digits++;
+    }
+    if (digits == 0)
+      return false;
+    v = negative ? -n : n;
+    return true;
+  }
+
+  void shiftDays(sdate &d) const {
+    if (addDays(d, days))
+      return;
+    std::chrono::year_month_day ymd(std::chrono::year(d.y), std::chrono::month(d.m), std::chrono::day(d.d));
+    ymd = std::chrono::sys_days{ymd} + std::chrono::days{days};
+    d.y = static_cast<int>(ymd.year());
+    d.m = static_cast<unsigned>(ymd.month());
+    d.d = static_cast<unsigned>(ymd.day());
+  }
+
+  // like printf("%0<width>ld")
+  void appendField(long v, int width) {
+    if (v < 0 || v > 9999) {
+      char buf[32];
+      snprintf(buf, sizeof(buf), "%0*ld", width, v);
+      result += buf;
+      return;
+    }
+    char buf[4];
+    int n = 0;
+    do {
+      buf[n++] = '0' + v % 10;
+      v /= 10;
+    } while (v > 0);
+    for (int i = n; i < width; i++)
+      result += '0';
+    while (n > 0)
+      result += buf[--n];
+  }
+
+  long days;
+  std::string key;    // memo key of the current value
+  std::string result; // the shifted value
+  std::unordered_map<std::string, std::string> memo;
+};
+
+#endif /* INCLUDE_DATESHIFT_HPP_ */
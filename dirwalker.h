@@ -0,0 +1,150 @@
+#ifndef INCLUDE_DIRWALKER_HPP_
+#define INCLUDE_DIRWALKER_HPP_
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Parallel directory walker.
+//
+// Directories are kept on a shared stack. Each walker thread takes a directory from the
+// stack, lists it with readdir() and pushes all sub-directories back onto the stack, so
+// that the different levels of a patient/study/series/instance hierarchy are listed by
+// all threads at the same time. The file type is taken from d_type, a stat() is only
+// needed for symbolic links and for file systems that do not report the type.
+// Like std::filesystem::recursive_directory_iterator symbolic links to directories are
+// not followed, symbolic links to files are reported as files.
+class DirectoryWalker {
+public:
+  struct Stats {
+    size_t entries = 0;     // directory entries seen (without . and ..)
+    size_t files = 0;       // regular files reported
+    size_t directories = 0; // directories listed
+    size_t errors = 0;      // directories that could not be opened
+    double seconds = 0;     // wall-clock time of the walk
+  };
+
+  // onFile is called for every regular file, from all walker threads concurrently
+  DirectoryWalker(std::function<void(std::string &&)> onFile) : onFile(onFile), pending(0) {}
+
+  // walk the tree below path using nthreads threads (including the calling thread)
+  void run(const std::string &path, unsigned int nthreads) {
+    auto start = std::chrono::steady_clock::now();
+    stack.push_back(path);
+    pending = 1;
+    std::vector<std::thread> threads;
+    for (unsigned int i = 1; i < nthreads; i++)
+      threads.emplace_back(&DirectoryWalker::work, this);
+    work();
+    for (auto &t : threads)
+      t.join();
+    stats.entries = entries.load();
+    stats.files = files.load();
+    stats.directories = directories.load();
+    stats.errors = errors.load();
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  }
+
+  const Stats &getStats() const { return stats; }
+
+private:
+  void work() {
+    std::string dir;
+    while (nextDirectory(dir)) {
+      listDirectory(dir);
+      finishedDirectory();
+    }
+  }
+
+  // wait for a directory to list, returns false once no directory is left and no other
+  // thread is still listing one (that could add more)
+  bool nextDirectory(std::string &dir) {
+    std::unique_lock<std::mutex> lock(mutex);
+    cond.wait(lock, [this] { return !stack.empty() || pending == 0; });
+    if (stack.empty())
+      return false;
+    dir = std::move(stack.back());
+    stack.pop_back();
+    return true;
+  }
+
+  void finishedDirectory() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (--pending == 0)
+      cond.notify_all();
+  }
+
+  void listDirectory(const std::string &dir) {
+    DIR *d = opendir(dir.c_str());
+    if (!d) {
+      errors++;
+      fprintf(stderr, "Warning: could not open directory \"%s\".\n", dir.c_str());
+      return;
+    }
+    directories++;
+    std::string prefix = dir;
+    if (prefix.empty() || prefix.back() != '/')
+      prefix += "/";
+    std::vector<std::string> subdirs;
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+      const char *name = entry->d_name;
+      if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+        continue;
+      entries++;
+      std::string fullpath = prefix + name;
+      unsigned char type = entry->d_type;
+      if (type == DT_UNKNOWN) { // file system does not tell us, ask for it
+        struct stat st;
+        if (lstat(fullpath.c_str(), &st) != 0)
+          continue;
+        type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISLNK(st.st_mode) ? DT_LNK : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+      }
+      if (type == DT_LNK) { // follow links to files but do not walk into linked directories
+        struct stat st;
+        if (stat(fullpath.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+          continue;
+        type = DT_REG;
+      }
+      if (type == DT_DIR) {
+        subdirs.push_back(std::move(fullpath));
+      } else if (type == DT_REG) {
+        files++;
+        onFile(std::move(fullpath));
+      }
+    }
+    closedir(d);
+    if (!subdirs.empty()) {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending += subdirs.size();
+        for (auto &s : subdirs)
+          stack.push_back(std::move(s));
+      }
+      cond.notify_all();
+    }
+  }
+
+  std::function<void(std::string &&)> onFile;
+  std::mutex mutex;
+  std::condition_variable cond;
+  std::vector<std::string> stack; // directories that still need to be listed
+  size_t pending;                 // directories on the stack or currently being listed
+  std::atomic<size_t> entries{0};
+  std::atomic<size_t> files{0};
+  std::atomic<size_t> directories{0};
+  std::atomic<size_t> errors{0};
+  Stats stats;
+};
+
+#endif /* INCLUDE_DIRWALKER_HPP_ */
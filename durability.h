@@ -0,0 +1,291 @@
+#ifndef INCLUDE_DURABILITY_HPP_
+#define INCLUDE_DURABILITY_HPP_
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Output files are written to a temporary name in their final directory and renamed when
+// they are complete, a crash never leaves a truncated file under the final name. How much
+// is done to make them survive a crash of the machine is set with --fsync:
+//
+//   none   the files are renamed as soon as they are written, the kernel writes them back
+//          whenever it wants (fastest)
+//   file   every file is written to disk (fsync) before it is renamed, the rename is written
+//          to disk with an fsync of the directory
+//   group  files are renamed in batches, a batch is written to disk with one syncfs of the
+//          output file system after N files or M milliseconds, whatever comes first, a second
+//          syncfs writes the renames of the batch to disk. The time is checked when a file is
+//          committed and before a worker starts on its next file, a batch can wait longer than
+//          M milliseconds while a worker is busy with a single file.
+//
+// With file and group a file is only reported as done (and recorded in the journal) when its
+// data and its final name are on disk.
+struct DurabilityPolicy {
+  enum Mode { None, File, Group };
+  Mode mode = None;
+  size_t groupFiles = 64;    // group: sync after this many files
+  unsigned groupMillis = 1000; // group: or after this time since the first file of the batch
+
+  // "none", "file", "group", "group:N" or "group:N:M", returns false for anything else
+  bool parse(const char *arg) {
+    std::string s(arg);
+    if (s == "none") {
+      mode = None;
+      return true;
+    }
+    if (s == "file") {
+      mode = File;
+      return true;
+    }
+    if (s.compare(0, 5, "group") != 0)
+      return false;
+    mode = Group;
+    if (s.size() == 5)
+      return true;
+    if (s[5] != ':')
+      return false;
+    char *end;
+    unsigned long n = strtoul(s.c_str() + 6, &end, 10);
+    if (end == s.c_str() + 6 || n == 0)
+      return false;
+    groupFiles = n;
+    if (*end == '\0')
+      return true;
+    if (*end != ':')
+      return false;
+    const char *ms = end + 1;
+    unsigned long m = strtoul(ms, &end, 10);
+    if (end == ms || *end != '\0')
+      return false;
+    groupMillis = (unsigned)m;
+    return true;
+  }
+
+  const char *name() const { return mode == None ? "none" : mode == File ? "file" : "group"; }
+};
+
+// Latency histogram of the fsync and syncfs calls, bucket i counts the calls that took less
+// than 2^i microseconds (and at least 2^(i-1)).
+struct SyncHistogram {
+  static const int nbuckets = 32;
+  size_t buckets[nbuckets] = {};
+  size_t calls = 0;
+  double seconds = 0;
+  double maxSeconds = 0;
+
+  void add(double s) {
+    calls++;
+    seconds += s;
+    if (s > maxSeconds)
+      maxSeconds = s;
+    uint64_t us = (uint64_t)(s * 1e6);
+    int b = 0;
+    while (b < nbuckets - 1 && (1ull << b) <= us)
+      b++;
+    buckets[b]++;
+  }
+
+  void merge(const SyncHistogram &other) {
+    for (int i = 0; i < nbuckets; i++)
+      buckets[i] += other.buckets[i];
+    calls += other.calls;
+    seconds += other.seconds;
+    if (other.maxSeconds > maxSeconds)
+      maxSeconds = other.maxSeconds;
+  }
+
+  void print(FILE *out) const {
+    fprintf(out, "fsync latency: %zu call%s, mean %.3f ms, max %.3f ms\n", calls, calls == 1 ? "" : "s", calls ? seconds / calls * 1e3 : 0.0,
+            maxSeconds * 1e3);
+    for (int i = 0; i < nbuckets; i++)
+      if (buckets[i] > 0)
+        fprintf(out, "  < %10llu us: %zu\n", 1ull << i, buckets[i]);
+  }
+};
+
+// Moves the output files of one worker thread from their temporary to their final names
+// following the policy.
+class OutputCommitter {
+public:
+  struct Stats {
+    size_t committed = 0; // files renamed to their final name
+    size_t failed = 0;    // files removed because writing, syncing or renaming failed
+    size_t groups = 0;    // syncfs batches
+    SyncHistogram sync;
+  };
+
+  // tag makes the temporary names of different committers (threads) distinct
+  OutputCommitter(const DurabilityPolicy &policy, const std::string &outputdir, int tag)
+      : policy(policy), outputdir(outputdir), suffix(".part" + std::to_string(tag)) {}
+  ~OutputCommitter() { finish(); }
+  OutputCommitter(const OutputCommitter &) = delete;
+  OutputCommitter &operator=(const OutputCommitter &) = delete;
+
+  // the name to write finalName to, hidden and without the .dcm suffix so importers ignore it
+  std::string temporaryName(const std::string &finalName) const {
+    size_t slash = finalName.find_last_of('/');
+    size_t base = slash == std::string::npos ? 0 : slash + 1;
+    return finalName.substr(0, base) + "." + finalName.substr(base) + suffix;
+  }
+
+  // called with true once a file has its final name, with false if it was removed
+  typedef std::function<void(bool ok)> Done;
+
+  // The file was written to temporaryName(finalName). If ok is false (the write failed) the
+  // temporary file is removed. done is called when the file got its final name (for the group
+  // policy that is after the sync of its group).
+  void commit(const std::string &finalName, bool ok, Done done = nullptr) {
+    std::string tmp = temporaryName(finalName);
+    if (!ok) {
+      discard(tmp);
+      if (done)
+        done(false);
+      return;
+    }
+    switch (policy.mode) {
+    case DurabilityPolicy::None:
+      ok = rename(tmp, finalName);
+      break;
+    case DurabilityPolicy::File:
+      if (syncFile(tmp)) {
+        ok = rename(tmp, finalName) && syncDirectory(finalName);
+      } else {
+        fprintf(stderr, "Error: fsync of \"%s\" failed (%s).\n", tmp.c_str(), strerror(errno));
+        discard(tmp);
+        ok = false;
+      }
+      break;
+    case DurabilityPolicy::Group:
+      if (pending.empty())
+        groupStart = std::chrono::steady_clock::now();
+      pending.emplace_back(finalName, std::move(done));
+      if (pending.size() >= policy.groupFiles)
+        flush();
+      else
+        poll();
+      return;
+    }
+    if (done)
+      done(ok);
+  }
+
+  // sync and rename the files of the current group, the renames are synced before the files
+  // are reported as done
+  void flush() {
+    if (pending.empty())
+      return;
+    stats.groups++;
+    bool ok = syncFileSystem();
+    if (!ok)
+      fprintf(stderr, "Error: syncfs of \"%s\" failed (%s), %zu files removed.\n", outputdir.c_str(), strerror(errno), pending.size());
+    std::vector<bool> renamed(pending.size(), false);
+    for (size_t i = 0; i < pending.size(); i++) {
+      std::string tmp = temporaryName(pending[i].first);
+      if (ok)
+        renamed[i] = rename(tmp, pending[i].first);
+      else
+        discard(tmp);
+    }
+    bool durable = ok && syncFileSystem();
+    if (ok && !durable)
+      fprintf(stderr, "Error: syncfs of the renames in \"%s\" failed (%s).\n", outputdir.c_str(), strerror(errno));
+    for (size_t i = 0; i < pending.size(); i++)
+      if (pending[i].second)
+        pending[i].second(renamed[i] && durable);
+    pending.clear();
+  }
+
+  // group: flush the current group if its time is up, called by the worker before each file
+  void poll() {
+    if (!pending.empty() && std::chrono::steady_clock::now() - groupStart >= std::chrono::milliseconds(policy.groupMillis))
+      flush();
+  }
+
+  // at the end of the run, everything is synced and renamed
+  void finish() { flush(); }
+
+  const Stats &getStats() const { return stats; }
+
+private:
+  bool rename(const std::string &from, const std::string &to) {
+    if (::rename(from.c_str(), to.c_str()) != 0) {
+      fprintf(stderr, "Error: could not rename \"%s\" to \"%s\" (%s).\n", from.c_str(), to.c_str(), strerror(errno));
+      discard(from);
+      return false;
+    }
+    stats.committed++;
+    return true;
+  }
+
+  void discard(const std::string &tmp) {
+    unlink(tmp.c_str());
+    stats.failed++;
+  }
+
+  bool syncFile(const std::string &name) {
+    int fd = open(name.c_str(), O_RDONLY);
+    if (fd < 0)
+      return false;
+    auto t0 = std::chrono::steady_clock::now();
+    bool ok = fsync(fd) == 0;
+    stats.sync.add(std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count());
+    close(fd);
+    return ok;
+  }
+
+  // write the directory entry of a renamed file to disk
+  bool syncDirectory(const std::string &name) {
+    size_t slash = name.find_last_of('/');
+    std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : name.substr(0, slash);
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    bool ok = fd >= 0;
+    if (ok) {
+      auto t0 = std::chrono::steady_clock::now();
+      ok = fsync(fd) == 0;
+      stats.sync.add(std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count());
+      close(fd);
+    }
+    if (!ok)
+      fprintf(stderr, "Error: fsync of the directory \"%s\" failed (%s).\n", dir.c_str(), strerror(errno));
+    return ok;
+  }
+
+  // write all dirty data of the output file system to disk
+  bool syncFileSystem() {
+    auto t0 = std::chrono::steady_clock::now();
+    bool ok = true;
+#ifdef __linux__
+    int fd = open(outputdir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+      return false;
+    ok = syncfs(fd) == 0;
+    close(fd);
+#else
+    sync();
+#endif
+    stats.sync.add(std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count());
+    return ok;
+  }
+
+  DurabilityPolicy policy;
+  std::string outputdir;
+  std::string suffix;
+  std::vector<std::pair<std::string, Done>> pending; // group: files written but not synced yet
+  std::chrono::steady_clock::time_point groupStart;
+  Stats stats;
+};
+
+#endif /* INCLUDE_DURABILITY_HPP_ */
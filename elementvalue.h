@@ -0,0 +1,58 @@
+#ifndef INCLUDE_ELEMENTVALUE_HPP_
+#define INCLUDE_ELEMENTVALUE_HPP_
+
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+#include "gdcmByteValue.h"
+#include "gdcmConfigure.h"
+#include "gdcmDataElement.h"
+
+// Overwrite the value of a data element that is stored in a DataSet.
+//
+// Only the value changes, the tag (the key of the DataSet) stays the same, so the element can
+// be changed in place instead of copying it out of the set and calling DataSet::Replace. The
+// existing buffer is reused if no other element shares it: copies of a DataElement (made by
+// gdcm::Anonymizer, DataSet copies, items of sequences) share the ByteValue through a
+// SmartPointer and must keep their value, those elements get a new ByteValue instead.
+
+namespace gdcm {
+struct ReferenceCountProbe;
+// gdcm keeps the reference count of its objects private, SmartPointer is a friend of Object.
+// This specialization is only used to read the count. It relies on Object as it is in gdcm 3.0
+// (long ReferenceCount, friend class template SmartPointer), check it again before building
+// against another version.
+static_assert(GDCM_MAJOR_VERSION == 3 && GDCM_MINOR_VERSION == 0, "setValue reads gdcm::Object::ReferenceCount of gdcm 3.0");
+template <> class SmartPointer<ReferenceCountProbe> {
+public:
+  static long count(const Object &o) {
+    static_assert(std::is_same<decltype(Object::ReferenceCount), long>::value, "gdcm::Object::ReferenceCount changed");
+    return o.ReferenceCount;
+  }
+};
+} // namespace gdcm
+
+// true if bv is referenced by more than one DataElement (the value is shared)
+inline bool isSharedValue(const gdcm::ByteValue &bv) { return gdcm::SmartPointer<gdcm::ReferenceCountProbe>::count(bv) != 1; }
+
+// odd length values are padded with a null byte like DataElement::SetByteValue does
+inline void setValue(const gdcm::DataElement &de, const char *array, uint32_t length) {
+  gdcm::DataElement &mde = const_cast<gdcm::DataElement &>(de);
+  gdcm::ByteValue *bv = const_cast<gdcm::ByteValue *>(mde.GetByteValue());
+  if (!bv || isSharedValue(*bv)) {
+    mde.SetByteValue(array, length);
+    return;
+  }
+  uint32_t evenlength = length + (length & 1);
+  bv->SetLength(evenlength);
+  char *p = (char *)bv->GetVoidPointer();
+  if (p && length > 0) {
+    memcpy(p, array, length);
+    if (length & 1)
+      p[length] = '\0';
+  }
+  mde.SetVL(evenlength);
+}
+
+#endif /* INCLUDE_ELEMENTVALUE_HPP_ */
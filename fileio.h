@@ -0,0 +1,326 @@
+#ifndef INCLUDE_FILEIO_HPP_
+#define INCLUDE_FILEIO_HPP_
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <streambuf>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Low level file helpers for reading and writing the DICOM files.
+//
+// Pixel splicing: files are read by gdcm only up to the PixelData element. The value of
+// PixelData (and the element header in front of it) is copied from the input to the output
+// file without being parsed, the data never passes through user space if the kernel supports
+// copy_file_range.
+//
+// Memory mapped input: gdcm reads from an std::istream on top of a read-only mapping of the
+// file instead of an std::ifstream, so there is no extra copy into the stream buffer and
+// only the pages the parser touches are read from disk.
+//
+// Read ahead: the kernel is asked to read the next files of a worker into the page cache
+// while the worker is still busy with the current file (posix_fadvise WILLNEED). On network
+// storage this hides the latency of the first access to each file.
+
+// little endian 16 and 32 bit values from the file, the transfer syntax is checked by the caller
+inline uint16_t readLE16(const unsigned char *p) { return (uint16_t)(p[0] | (p[1] << 8)); }
+inline uint32_t readLE32(const unsigned char *p) {
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// read exactly n bytes at offset
+inline bool preadAll(int fd, void *buf, size_t n, uintmax_t offset) {
+  char *p = (char *)buf;
+  while (n > 0) {
+    ssize_t r = pread(fd, p, n, (off_t)offset);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      return false;
+    p += r;
+    n -= r;
+    offset += r;
+  }
+  return true;
+}
+
+// Find the byte range of the PixelData element (7fe0,0010) whose element header ends at
+// headerEnd (the stream position after gdcm::Reader::ReadUpToTag). The element header is 8
+// bytes long for implicit and 12 bytes for explicit little endian (PixelData is OB, OW or UN).
+// Encapsulated pixel data has an undefined length, its fragments are skipped up to the sequence
+// delimiter. Returns false if there is no valid PixelData element at this position.
+inline bool pixelDataExtent(int fd, uintmax_t headerEnd, bool implicitVR, uintmax_t &start, uintmax_t &end) {
+  const size_t headerLength = implicitVR ? 8 : 12;
+  if (headerEnd < headerLength)
+    return false;
+  start = headerEnd - headerLength;
+  unsigned char h[12];
+  if (!preadAll(fd, h, headerLength, start))
+    return false;
+  if (readLE16(h) != 0x7fe0 || readLE16(h + 2) != 0x0010)
+    return false;
+  uint32_t vl;
+  if (implicitVR) {
+    vl = readLE32(h + 4);
+  } else {
+    if (!((h[4] == 'O' && (h[5] == 'B' || h[5] == 'W')) || (h[4] == 'U' && h[5] == 'N')))
+      return false;
+    vl = readLE32(h + 8);
+  }
+  if (vl != 0xFFFFFFFF) {
+    end = headerEnd + vl;
+    return true;
+  }
+  // encapsulated, walk over the items (basic offset table and fragments)
+  uintmax_t pos = headerEnd;
+  for (;;) {
+    unsigned char item[8];
+    if (!preadAll(fd, item, 8, pos))
+      return false;
+    uint16_t group = readLE16(item), element = readLE16(item + 2);
+    uint32_t length = readLE32(item + 4);
+    if (group != 0xfffe)
+      return false;
+    pos += 8;
+    if (element == 0xe0dd) { // sequence delimitation item
+      end = pos;
+      return true;
+    }
+    if (element != 0xe000 || length == 0xFFFFFFFF)
+      return false;
+    pos += length;
+  }
+}
+
+// Append length bytes of the input file starting at offset to the end of the output file.
+// Uses copy_file_range on Linux (no copy through user space, reflinks on some file systems)
+// and falls back to pread/write if the kernel or the file systems do not support it.
+inline bool appendFileRange(int in, uintmax_t offset, uintmax_t length, int out) {
+  struct stat st;
+  if (fstat(out, &st) != 0)
+    return false;
+  uintmax_t outOffset = st.st_size;
+#ifdef __linux__
+  {
+    loff_t inPos = offset, outPos = outOffset;
+    uintmax_t left = length;
+    while (left > 0) {
+      ssize_t r = copy_file_range(in, &inPos, out, &outPos, left, 0);
+      if (r < 0 && errno == EINTR)
+        continue;
+      if (r <= 0)
+        break;
+      left -= r;
+    }
+    if (left == 0)
+      return true;
+    // not supported (EXDEV, ENOSYS, EINVAL, ...) or short copy, continue with the fallback
+    offset = inPos;
+    outOffset = outPos;
+    length = left;
+  }
+#endif
+  std::vector<char> buffer(1 << 20);
+  while (length > 0) {
+    size_t n = length < buffer.size() ? (size_t)length : buffer.size();
+    if (!preadAll(in, buffer.data(), n, offset))
+      return false;
+    size_t done = 0;
+    while (done < n) {
+      ssize_t w = pwrite(out, buffer.data() + done, n - done, (off_t)(outOffset + done));
+      if (w < 0 && errno == EINTR)
+        continue;
+      if (w <= 0)
+        return false;
+      done += w;
+    }
+    offset += n;
+    outOffset += n;
+    length -= n;
+  }
+  return true;
+}
+
+// Read-only std::streambuf over a block of memory, supports the seeks gdcm does while parsing.
+class MemoryStreamBuf : public std::streambuf {
+public:
+  MemoryStreamBuf() {}
+
+  void reset(const char *data, size_t size) {
+    char *p = const_cast<char *>(data); // the get area is never written to
+    setg(p, p, p + size);
+  }
+
+protected:
+  pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override {
+    if (!(which & std::ios_base::in))
+      return pos_type(off_type(-1));
+    char *base = dir == std::ios_base::beg ? eback() : dir == std::ios_base::cur ? gptr() : egptr();
+    if ((off < 0 && -off > base - eback()) || (off > 0 && off > egptr() - base))
+      return pos_type(off_type(-1));
+    setg(eback(), base + off, egptr());
+    return pos_type(gptr() - eback());
+  }
+
+  pos_type seekpos(pos_type pos, std::ios_base::openmode which) override { return seekoff(off_type(pos), std::ios_base::beg, which); }
+
+  std::streamsize showmanyc() override { return egptr() - gptr(); }
+};
+
+// An std::istream over a block of memory (gdcm::Reader::SetStream).
+class MemoryInput {
+public:
+  MemoryInput() : in(&buf) {}
+  MemoryInput(const MemoryInput &) = delete;
+  MemoryInput &operator=(const MemoryInput &) = delete;
+
+  void reset(const char *data, size_t size) {
+    buf.reset(data, size);
+    in.clear();
+  }
+
+  // rewind, the stream can be read again from the start
+  std::istream &stream() {
+    in.clear();
+    in.seekg(0);
+    return in;
+  }
+
+private:
+  MemoryStreamBuf buf;
+  std::istream in;
+};
+
+// A file mapped into memory and an std::istream to read it.
+class MappedInput {
+public:
+  MappedInput() : addr(MAP_FAILED), length(0) {}
+  ~MappedInput() { close(); }
+  MappedInput(const MappedInput &) = delete;
+  MappedInput &operator=(const MappedInput &) = delete;
+
+  // Map the file, returns false if that is not possible (empty file, special file, ...).
+  // The file is read front to back, the kernel can read ahead aggressively and drop pages
+  // we are done with. Transparent huge pages are only used for file mappings by some kernels
+  // and file systems, otherwise the hint is ignored.
+  bool open(const char *filename, bool hugepages) {
+    close();
+    int fd = ::open(filename, O_RDONLY);
+    if (fd < 0)
+      return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+      ::close(fd);
+      return false;
+    }
+    void *p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd); // the mapping keeps its own reference to the file
+    if (p == MAP_FAILED)
+      return false;
+    addr = p;
+    length = (size_t)st.st_size;
+    madvise(addr, length, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+    if (hugepages)
+      madvise(addr, length, MADV_HUGEPAGE);
+#endif
+    input.reset((const char *)addr, length);
+    return true;
+  }
+
+  void close() {
+    if (addr != MAP_FAILED)
+      munmap(addr, length);
+    addr = MAP_FAILED;
+    length = 0;
+    input.reset(NULL, 0);
+  }
+
+  // rewind, the stream can be read again from the start
+  std::istream &stream() { return input.stream(); }
+
+  size_t size() const { return length; }
+
+private:
+  MemoryInput input;
+  void *addr;
+  size_t length;
+};
+
+// Ask the kernel to read the next files of a worker into the page cache.
+//
+// update() gets the files the worker will process next, in order. Up to maxFiles of them and
+// up to window bytes in total are announced with posix_fadvise(WILLNEED), which starts the
+// reads in the background and returns. A file that does not fit into the window completely
+// is announced up to the end of the window (the header is what the parser needs first).
+// Files are announced only once, they are forgotten when they drop out of the list.
+class ReadAhead {
+public:
+  struct Stats {
+    size_t files = 0;     // files announced
+    uintmax_t bytes = 0;  // bytes announced
+    size_t failed = 0;    // files that could not be opened
+  };
+
+  ReadAhead(size_t maxFiles, uintmax_t window) : maxFiles(maxFiles), window(window) {}
+
+  size_t numFiles() const { return maxFiles; }
+
+  void update(const std::vector<const char *> &upcoming) {
+    std::unordered_map<std::string, uintmax_t> keep;
+    uintmax_t bytes = 0;
+    for (size_t i = 0; i < upcoming.size() && i < maxFiles && bytes < window; i++) {
+      std::string name(upcoming[i]);
+      auto it = advised.find(name);
+      uintmax_t length;
+      if (it != advised.end()) {
+        length = it->second;
+      } else {
+        length = advise(upcoming[i], window - bytes);
+      }
+      bytes += length;
+      keep.emplace(std::move(name), length);
+    }
+    advised.swap(keep);
+  }
+
+  const Stats &getStats() const { return stats; }
+
+private:
+  // returns the number of bytes announced
+  uintmax_t advise(const char *filename, uintmax_t limit) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+      stats.failed++;
+      return 0;
+    }
+    struct stat st;
+    uintmax_t length = 0;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+      length = (uintmax_t)st.st_size < limit ? (uintmax_t)st.st_size : limit;
+#ifdef POSIX_FADV_WILLNEED
+      posix_fadvise(fd, 0, (off_t)length, POSIX_FADV_WILLNEED);
+#endif
+      stats.files++;
+      stats.bytes += length;
+    }
+    close(fd);
+    return length;
+  }
+
+  size_t maxFiles;
+  uintmax_t window;
+  std::unordered_map<std::string, uintmax_t> advised; // file name and bytes announced
+  Stats stats;
+};
+
+#endif /* INCLUDE_FILEIO_HPP_ */
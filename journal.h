@@ -0,0 +1,296 @@
+#ifndef INCLUDE_JOURNAL_HPP_
+#define INCLUDE_JOURNAL_HPP_
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// Append-only journal of the processed files (--journal) so an interrupted run can be
+// continued with --resume.
+//
+// Every line is one file: status, size and modification time of the input file, input and
+// output path, separated by tabs (tabs, newlines and backslashes in the paths are escaped).
+//
+//   ok	1234	1700000000123456789	/in/a.dcm	/out/1.2.3.dcm
+//
+// Every run first appends a run line with a fingerprint of its settings (rules, project, patient
+// id, ...) and its output directory. The lines that follow belong to that run:
+//
+//   run	5f2c...e1	/out
+//
+// A file counts as done if its last line has status ok, was written by a run with the same
+// settings and output directory and size and modification time of the input file did not
+// change since. In incremental mode the output file of that line must also still exist and be
+// at least as new as the input file (nightly reruns over folders that are mostly unchanged:
+// only new or changed files are processed again). The workers collect their lines in a
+// Journal::Buffer and append them in batches with one write() (O_APPEND, whole lines) under a
+// lock. Lines are only recorded after the output file has its final name (see
+// OutputCommitter). The journal is only used with the durability policies file and group, the
+// data and the name of an output file are on disk before its line is written, an ok line
+// survives a crash only together with its complete output file (with the policy none a crash
+// could leave ok lines for outputs that are empty or truncated and --resume would skip their
+// inputs).
+class Journal {
+public:
+  struct Stats {
+    size_t loaded = 0;  // files marked as done in the journal that was loaded
+    size_t other = 0;   // ok lines ignored, their run had other settings or another output directory
+    size_t skipped = 0; // files skipped because they were done
+    size_t recorded = 0;
+    size_t appends = 0; // write() calls
+  };
+
+  Journal() {}
+  ~Journal() { close(); }
+  Journal(const Journal &) = delete;
+  Journal &operator=(const Journal &) = delete;
+
+  // Open the journal for appending, with resume (or incremental) load the lines it has already.
+  // With sync every batch is written to disk (fdatasync) before the workers continue. settings
+  // (a fingerprint of everything that changes the output files) and outputdir describe this
+  // run, only lines of earlier runs with the same ones are loaded.
+  bool open(const std::string &path, bool resume, bool incremental, bool sync, const std::string &settings, const std::string &outputdir) {
+    this->sync = sync;
+    this->incremental = incremental;
+    if ((resume || incremental) && !load(path, settings, outputdir))
+      return false;
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0666);
+    if (fd < 0) {
+      fprintf(stderr, "Error: could not open the journal \"%s\" (%s).\n", path.c_str(), strerror(errno));
+      return false;
+    }
+    // an earlier run stopped in the middle of a line, end it so our first line stays intact
+    struct stat st;
+    char last;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      int rd = ::open(path.c_str(), O_RDONLY);
+      if (rd >= 0) {
+        if (pread(rd, &last, 1, st.st_size - 1) == 1 && last != '\n' && write(fd, "\n", 1) != 1)
+          fprintf(stderr, "Warning: could not end the last line of the journal \"%s\".\n", path.c_str());
+        ::close(rd);
+      }
+    }
+    std::string run = "run\t" + settings + "\t";
+    escape(run, outputdir);
+    run += '\n';
+    std::lock_guard<std::mutex> lock(mutex);
+    return writeLines(run);
+  }
+
+  bool isOpen() const { return fd >= 0; }
+
+  // true if the file was completed by an earlier run, lock free (the table is only read),
+  // files that are not in the table cost no system call. If the input file had to be looked at
+  // st is its stat and statted is set, the caller does not need to stat it again.
+  bool done(const char *filename, struct stat &st, bool &statted) {
+    statted = false;
+    if (completed.empty())
+      return false;
+    auto it = completed.find(filename);
+    if (it == completed.end())
+      return false;
+    struct stat out;
+    if (stat(filename, &st) != 0)
+      return false;
+    statted = true;
+    if (it->second.size != (uintmax_t)st.st_size || it->second.mtime != mtimeOf(st))
+      return false;
+    if (incremental && (stat(it->second.output.c_str(), &out) != 0 || mtimeOf(out) < mtimeOf(st)))
+      return false;
+    skipped++;
+    return true;
+  }
+
+  // true if the file is in the journal of the earlier run (it is likely to be skipped), no system call
+  bool listed(const char *filename) const { return !completed.empty() && completed.find(filename) != completed.end(); }
+
+  static int64_t mtimeOf(const struct stat &st) {
+#ifdef __APPLE__
+    return (int64_t)st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+    return (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+  }
+
+  // lines of one worker thread, appended to the journal every batch lines or interval
+  class Buffer {
+  public:
+    Buffer(Journal &journal, size_t batch = 256, unsigned millis = 1000) : journal(journal), batch(batch), interval(millis) {}
+    ~Buffer() { flush(); }
+    Buffer(const Buffer &) = delete;
+    Buffer &operator=(const Buffer &) = delete;
+
+    void add(bool ok, uintmax_t size, int64_t mtime, const std::string &input, const std::string &output) {
+      if (!journal.isOpen())
+        return;
+      if (lines == 0)
+        first = std::chrono::steady_clock::now();
+      data += ok ? "ok\t" : "failed\t";
+      data += std::to_string(size);
+      data += '\t';
+      data += std::to_string(mtime);
+      data += '\t';
+      escape(input);
+      data += '\t';
+      escape(output);
+      data += '\n';
+      lines++;
+      if (lines >= batch || std::chrono::steady_clock::now() - first >= interval)
+        flush();
+    }
+
+    void flush() {
+      if (lines == 0)
+        return;
+      journal.append(data, lines);
+      data.clear();
+      lines = 0;
+    }
+
+  private:
+    void escape(const std::string &s) { Journal::escape(data, s); }
+
+    Journal &journal;
+    size_t batch;
+    std::chrono::milliseconds interval;
+    std::string data;
+    size_t lines = 0;
+    std::chrono::steady_clock::time_point first;
+  };
+
+  void close() {
+    if (fd >= 0)
+      ::close(fd);
+    fd = -1;
+  }
+
+  Stats getStats() {
+    std::lock_guard<std::mutex> lock(mutex);
+    Stats s = stats;
+    s.skipped = skipped.load();
+    return s;
+  }
+
+private:
+  struct Entry {
+    uintmax_t size;
+    int64_t mtime;
+    std::string output;
+  };
+
+  void append(const std::string &data, size_t lines) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!writeLines(data))
+      return;
+    stats.recorded += lines;
+    stats.appends++;
+  }
+
+  // whole lines with one write() (O_APPEND), the caller holds the lock
+  bool writeLines(const std::string &data) {
+    const char *p = data.data();
+    size_t n = data.size();
+    while (n > 0) {
+      ssize_t w = write(fd, p, n);
+      if (w < 0 && errno == EINTR)
+        continue;
+      if (w <= 0) {
+        fprintf(stderr, "Error: could not write to the journal (%s).\n", strerror(errno));
+        return false;
+      }
+      p += w;
+      n -= w;
+    }
+    if (sync)
+      fdatasync(fd);
+    return true;
+  }
+
+  static void escape(std::string &out, const std::string &s) {
+    for (char c : s) {
+      if (c == '\t')
+        out += "\\t";
+      else if (c == '\n')
+        out += "\\n";
+      else if (c == '\\')
+        out += "\\\\";
+      else
+        out += c;
+    }
+  }
+
+  static std::string unescape(const std::string &s) {
+    std::string r;
+    r.reserve(s.size());
+    for (size_t i = 0; i < s.size(); i++) {
+      if (s[i] == '\\' && i + 1 < s.size()) {
+        char c = s[++i];
+        r += c == 't' ? '\t' : c == 'n' ? '\n' : c;
+      } else {
+        r += s[i];
+      }
+    }
+    return r;
+  }
+
+  // read the lines of the earlier runs with the same settings and output directory, a missing
+  // journal is an empty one
+  bool load(const std::string &path, const std::string &settings, const std::string &outputdir) {
+    std::ifstream in(path);
+    if (!in.is_open())
+      return true;
+    std::string line;
+    bool matching = false; // the settings of lines before the first run line are not known
+    while (std::getline(in, line)) {
+      if (line.compare(0, 4, "run\t") == 0) {
+        size_t t = line.find('\t', 4);
+        matching = t != std::string::npos && line.compare(4, t - 4, settings) == 0 && unescape(line.substr(t + 1)) == outputdir;
+        continue;
+      }
+      // status, size, mtime, input, output - an incomplete last line (crash) is ignored
+      size_t t1 = line.find('\t'), t2, t3, t4;
+      if (t1 == std::string::npos || (t2 = line.find('\t', t1 + 1)) == std::string::npos || (t3 = line.find('\t', t2 + 1)) == std::string::npos ||
+          (t4 = line.find('\t', t3 + 1)) == std::string::npos)
+        continue;
+      std::string input = unescape(line.substr(t3 + 1, t4 - t3 - 1));
+      std::string output = unescape(line.substr(t4 + 1));
+      if (line.compare(0, t1, "ok") != 0 || !matching) {
+        if (!matching && line.compare(0, t1, "ok") == 0)
+          stats.other++;
+        completed.erase(input); // the output of the last line is not one of this run
+        continue;
+      }
+      Entry e;
+      e.size = strtoumax(line.c_str() + t1 + 1, NULL, 10);
+      e.mtime = strtoll(line.c_str() + t2 + 1, NULL, 10);
+      e.output = std::move(output);
+      completed[input] = std::move(e);
+    }
+    stats.loaded = completed.size();
+    return true;
+  }
+
+  int fd = -1;
+  bool sync = false;
+  bool incremental = false;
+  std::unordered_map<std::string, Entry> completed; // input files done by earlier runs
+  std::mutex mutex;
+  Stats stats;
+  std::atomic<size_t> skipped{0};
+};
+
+#endif /* INCLUDE_JOURNAL_HPP_ */
@@ -0,0 +1,219 @@
+#ifndef INCLUDE_SCHEDULER_HPP_
+#define INCLUDE_SCHEDULER_HPP_
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <numeric>
+#include <string>
+#include <vector>
+
+// Work-stealing scheduler for the list of input files.
+//
+// Every worker thread owns a deque of file indices. A worker takes its next file from
+// the front of its own deque. If its own deque is empty it looks at the other workers
+// (starting with its right neighbor) and steals half of the remaining entries from the
+// back of the first non-empty deque. A thread that lands on a directory of large
+// multi-frame files will therefore lose the rest of its share to idle threads instead
+// of deciding the wall-clock time of the whole run.
+//
+// The list of files is fixed before the workers start, so once a thread finds all
+// deques empty there is nothing left to do for it.
+class WorkStealingScheduler {
+public:
+  struct Stats {
+    size_t processed = 0; // files handed out to this thread
+    size_t stolen = 0;    // files this thread took from other threads
+    size_t steals = 0;    // number of successful steal operations
+  };
+
+  WorkStealingScheduler(unsigned int nthreads) : queues(nthreads), nqueues(nthreads), completed(0) {}
+
+  // add a file index to the deque of a thread (only before the workers are started)
+  void push(unsigned int thread, size_t idx) {
+    queues[thread].items.push_back(idx);
+  }
+
+  // fill the deques with contiguous blocks of the file list, same partition as before
+  void partition(size_t nfiles) {
+    const size_t part = nfiles / nqueues;
+    for (unsigned int thread = 0; thread < nqueues; thread++) {
+      size_t start = thread * part;
+      size_t end = (thread == nqueues - 1) ? nfiles : start + part;
+      for (size_t i = start; i < end; i++)
+        queues[thread].items.push_back(i);
+    }
+  }
+
+  // Longest processing time first: sort the files by size (largest first) and give each file
+  // to the thread that has the smallest number of bytes assigned so far. Each deque stays
+  // sorted by size so every thread starts with its largest files and steals happen on the
+  // small files at the end.
+  void partitionBySize(const uintmax_t *sizes, size_t nfiles) {
+    std::vector<size_t> order(nfiles);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [sizes](size_t a, size_t b) { return sizes[a] > sizes[b]; });
+    std::vector<uintmax_t> bytes(nqueues, 0);
+    for (size_t i = 0; i < nfiles; i++) {
+      unsigned int thread = std::min_element(bytes.begin(), bytes.end()) - bytes.begin();
+      queues[thread].items.push_back(order[i]);
+      bytes[thread] += sizes[order[i]];
+    }
+  }
+
+  // get the next file index for this thread, returns false if no work is left anywhere
+  bool next(unsigned int thread, size_t &idx) {
+    Queue &own = queues[thread];
+    {
+      std::lock_guard<std::mutex> lock(own.mutex);
+      if (!own.items.empty()) {
+        idx = own.items.front();
+        own.items.pop_front();
+        own.stats.processed++;
+        completed++;
+        return true;
+      }
+    }
+    // our own deque is empty, try to steal from the back of the other deques
+    for (unsigned int i = 1; i < nqueues; i++) {
+      Queue &victim = queues[(thread + i) % nqueues];
+      std::vector<size_t> loot;
+      {
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        size_t n = victim.items.size();
+        if (n == 0)
+          continue;
+        size_t take = (n + 1) / 2; // take half, at least one entry
+        loot.assign(victim.items.end() - take, victim.items.end());
+        victim.items.erase(victim.items.end() - take, victim.items.end());
+      }
+      std::lock_guard<std::mutex> lock(own.mutex);
+      idx = loot[0];
+      own.items.insert(own.items.end(), loot.begin() + 1, loot.end());
+      own.stats.processed++;
+      own.stats.stolen += loot.size();
+      own.stats.steals++;
+      completed++;
+      return true;
+    }
+    return false;
+  }
+
+  // the next n file indices of this thread without taking them (to read them ahead),
+  // files that are stolen in the meantime are processed by another thread
+  void peek(unsigned int thread, size_t n, std::vector<size_t> &out) {
+    Queue &own = queues[thread];
+    std::lock_guard<std::mutex> lock(own.mutex);
+    n = std::min(n, own.items.size());
+    out.assign(own.items.begin(), own.items.begin() + n);
+  }
+
+  // number of files handed out so far (used for progress reporting)
+  size_t numCompleted() const { return completed.load(std::memory_order_relaxed); }
+
+  const Stats &stats(unsigned int thread) const { return queues[thread].stats; }
+
+  unsigned int numThreads() const { return nqueues; }
+
+private:
+  // each deque sits on its own cache line to keep threads from sharing lock words
+  struct alignas(64) Queue {
+    std::mutex mutex;
+    std::deque<size_t> items;
+    Stats stats;
+  };
+  std::vector<Queue> queues;
+  unsigned int nqueues;
+  std::atomic<size_t> completed;
+};
+
+// Bounded queue of file names for the streaming mode.
+//
+// A directory walker pushes file names while the workers already pop and process them.
+// The walker blocks if the queue is full, so memory stays bounded independent of the
+// size of the input tree. After the walk is finished the walker calls close() and the
+// workers drain the queue and return.
+class FileQueue {
+public:
+  FileQueue(size_t capacity) : capacity(capacity), closed(false), pushed(0), popped(0) {}
+
+  // add a file, blocks while the queue is full
+  void push(std::string filename) {
+    std::unique_lock<std::mutex> lock(mutex);
+    notFull.wait(lock, [this] { return items.size() < capacity; });
+    items.push_back(std::move(filename));
+    pushed++;
+    lock.unlock();
+    notEmpty.notify_one();
+  }
+
+  // get the next file, blocks while the queue is empty and still open,
+  // returns false if the queue is closed and empty
+  bool pop(std::string &filename, size_t &idx) {
+    std::unique_lock<std::mutex> lock(mutex);
+    notEmpty.wait(lock, [this] { return !items.empty() || closed; });
+    if (items.empty())
+      return false;
+    filename = std::move(items.front());
+    items.pop_front();
+    idx = popped++;
+    lock.unlock();
+    notFull.notify_one();
+    return true;
+  }
+
+  // like pop() but does not wait, returns false if no file is available right now
+  bool tryPop(std::string &filename, size_t &idx) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (items.empty())
+      return false;
+    filename = std::move(items.front());
+    items.pop_front();
+    idx = popped++;
+    lock.unlock();
+    notFull.notify_one();
+    return true;
+  }
+
+  // the next n file names without taking them (to read them ahead), the queue is shared,
+  // any of the threads may process them
+  void peek(size_t n, std::vector<std::string> &out) {
+    std::lock_guard<std::mutex> lock(mutex);
+    n = std::min(n, items.size());
+    out.assign(items.begin(), items.begin() + n);
+  }
+
+  // no more files will be added
+  void close() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      closed = true;
+    }
+    notEmpty.notify_all();
+  }
+
+  size_t numPushed() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return pushed;
+  }
+
+  size_t numPopped() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return popped;
+  }
+
+private:
+  std::mutex mutex;
+  std::condition_variable notFull;
+  std::condition_variable notEmpty;
+  std::deque<std::string> items;
+  size_t capacity;
+  bool closed;
+  size_t pushed;
+  size_t popped;
+};
+
+#endif /* INCLUDE_SCHEDULER_HPP_ */
@@ -0,0 +1,65 @@
+#ifndef INCLUDE_TAGLOOKUP_HPP_
+#define INCLUDE_TAGLOOKUP_HPP_
+
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Lookup from a 32bit DICOM tag (group << 16 | element) to the index of its rule.
+//
+// This is asked for every data element of every file (including the elements inside
+// sequences) and most of the elements have no rule. A bitmap over the 65536 groups
+// rejects those without touching the table, the remaining tags are found with a
+// binary search in a sorted flat array.
+class TagLookup {
+public:
+  TagLookup() : groups(65536 / 64, 0) {}
+
+  // add a rule for a tag, if a tag is added more than once the first index is used
+  void add(uint32_t tag, int idx) { entries.push_back(std::make_pair(tag, idx)); }
+
+  // sort the table, needs to be called after all add() and before find()
+  void finalize() {
+    std::stable_sort(entries.begin(), entries.end(),
+                     [](const std::pair<uint32_t, int> &a, const std::pair<uint32_t, int> &b) { return a.first < b.first; });
+    entries.erase(std::unique(entries.begin(), entries.end(),
+                              [](const std::pair<uint32_t, int> &a, const std::pair<uint32_t, int> &b) { return a.first == b.first; }),
+                  entries.end());
+    std::fill(groups.begin(), groups.end(), 0);
+    tags.clear();
+    indices.clear();
+    for (const auto &e : entries) {
+      uint32_t group = e.first >> 16;
+      groups[group >> 6] |= uint64_t(1) << (group & 63);
+      tags.push_back(e.first);
+      indices.push_back(e.second);
+    }
+  }
+
+  // returns the index of the rule for this tag or -1
+  int find(uint32_t tag) const {
+    uint32_t group = tag >> 16;
+    if (!(groups[group >> 6] & (uint64_t(1) << (group & 63))))
+      return -1;
+    auto it = std::lower_bound(tags.begin(), tags.end(), tag);
+    if (it == tags.end() || *it != tag)
+      return -1;
+    return indices[it - tags.begin()];
+  }
+
+  void clear() {
+    entries.clear();
+    tags.clear();
+    indices.clear();
+    std::fill(groups.begin(), groups.end(), 0);
+  }
+
+private:
+  std::vector<std::pair<uint32_t, int>> entries;
+  std::vector<uint64_t> groups; // one bit for each group that has at least one rule
+  std::vector<uint32_t> tags;   // sorted tags
+  std::vector<int> indices;     // rule index for each entry in tags
+};
+
+#endif /* INCLUDE_TAGLOOKUP_HPP_ */
@@ -0,0 +1,237 @@
+#ifndef INCLUDE_UIDCACHE_HPP_
+#define INCLUDE_UIDCACHE_HPP_
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// String to string map shared by all worker threads.
+//
+// The entries are spread over a fixed number of shards by the hash of the key, each shard
+// has its own lock, so threads only wait for each other if they look at the same shard at
+// the same time. Like std::map::insert the first value stored for a key is kept.
+//
+// Used as a memo of hashed UIDs (the same StudyInstanceUID is hashed again for every file of
+// a study), to collect the old -> new UID mappings written with --exportmapping and as the
+// set of output directories that exist already.
+//
+// A memo is bounded with maxItems: a shard that is full is cleared before the next key is
+// added (the values are computed again if they are needed). The default keeps every entry.
+class ConcurrentMap {
+public:
+  ConcurrentMap(size_t nshards = 64, size_t maxItems = 0) : shards(nshards), maxShardItems(maxItems ? (maxItems + nshards - 1) / nshards : 0) {}
+
+  // returns true and the value if the key is known, counts hits and misses
+  bool find(const std::string &key, std::string &value) {
+    return find(key, [&value](const std::string &v) { value = v; });
+  }
+
+  // calls onValue with the value (under the lock of the shard) if the key is known
+  template <typename F> bool find(const std::string &key, F &&onValue) {
+    Shard &s = shard(key);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    auto it = s.items.find(key);
+    if (it == s.items.end()) {
+      s.misses++;
+      return false;
+    }
+    s.hits++;
+    onValue(it->second);
+    return true;
+  }
+
+  // Like find() but if the key is not known make(value) is called (under the lock of the shard,
+  // other threads asking for the same key wait for it) and the value is stored if make returns
+  // true. Returns false only if make failed. Used to do something exactly once per key.
+  template <typename F> bool findOrInsert(const std::string &key, F &&make) {
+    Shard &s = shard(key);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    if (s.items.find(key) != s.items.end()) {
+      s.hits++;
+      return true;
+    }
+    s.misses++;
+    std::string value;
+    if (!make(value))
+      return false;
+    makeRoom(s);
+    s.items.emplace(key, std::move(value));
+    return true;
+  }
+
+  // same as find() but does not count and does not copy the value
+  bool contains(const std::string &key) {
+    Shard &s = shard(key);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    return s.items.find(key) != s.items.end();
+  }
+
+  // add the key if it is not there yet, returns false if it was already known
+  bool insert(const std::string &key, const std::string &value) {
+    Shard &s = shard(key);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    if (s.items.find(key) != s.items.end())
+      return false;
+    makeRoom(s);
+    s.items.emplace(key, value);
+    return true;
+  }
+
+  // all entries sorted by key (call after the workers are done)
+  std::map<std::string, std::string> sorted() {
+    std::map<std::string, std::string> result;
+    for (auto &s : shards) {
+      std::lock_guard<std::mutex> lock(s.mutex);
+      result.insert(s.items.begin(), s.items.end());
+    }
+    return result;
+  }
+
+  size_t size() {
+    size_t n = 0;
+    for (auto &s : shards) {
+      std::lock_guard<std::mutex> lock(s.mutex);
+      n += s.items.size();
+    }
+    return n;
+  }
+
+  size_t hits() {
+    size_t n = 0;
+    for (auto &s : shards) {
+      std::lock_guard<std::mutex> lock(s.mutex);
+      n += s.hits;
+    }
+    return n;
+  }
+
+  size_t misses() {
+    size_t n = 0;
+    for (auto &s : shards) {
+      std::lock_guard<std::mutex> lock(s.mutex);
+      n += s.misses;
+    }
+    return n;
+  }
+
+  size_t evictions() {
+    size_t n = 0;
+    for (auto &s : shards) {
+      std::lock_guard<std::mutex> lock(s.mutex);
+      n += s.evictions;
+    }
+    return n;
+  }
+
+private:
+  // each shard sits on its own cache line to keep threads from sharing lock words
+  struct alignas(64) Shard {
+    std::mutex mutex;
+    std::unordered_map<std::string, std::string> items;
+    size_t hits = 0;
+    size_t misses = 0;
+    size_t evictions = 0; // times the shard was cleared because it was full
+  };
+
+  Shard &shard(const std::string &key) { return shards[std::hash<std::string>()(key) % shards.size()]; }
+
+  // called with the lock of the shard before a key is added
+  void makeRoom(Shard &s) {
+    if (maxShardItems > 0 && s.items.size() >= maxShardItems) {
+      s.items.clear();
+      s.evictions++;
+    }
+  }
+
+  std::vector<Shard> shards;
+  size_t maxShardItems; // 0: no limit
+};
+
+// Output files claimed by the worker threads, keyed by the name relative to the output
+// directory (the hashed SOPInstanceUID, with --byseries also the series directory).
+//
+// Exports often contain the same instance more than once, only the first copy is written. A
+// claim stays pending until the writer is done with the file. If the write fails the claim is
+// dropped and the next copy writes the file. Copies that arrive while the claim is pending
+// leave their journal line with the claim, the writer records those lines together with its
+// own once the output is on disk (or as failed if it could not be written).
+class OutputClaims {
+public:
+  enum State {
+    Claimed, // the caller writes the file
+    Pending, // another copy is being written
+    Written  // the output file exists already
+  };
+
+  // the journal line of a copy that was skipped
+  struct Waiter {
+    std::string input;
+    uintmax_t size;
+    int64_t mtime;
+  };
+
+  OutputClaims(size_t nshards = 64) : shards(nshards) {}
+
+  // claim name, waiter (may be NULL) is kept with a pending claim
+  State claim(const std::string &name, const Waiter *waiter) {
+    Shard &s = shard(name);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    auto it = s.claims.find(name);
+    if (it == s.claims.end()) {
+      s.claims.emplace(name, Claim());
+      return Claimed;
+    }
+    if (it->second.written)
+      return Written;
+    if (waiter)
+      it->second.waiters.push_back(*waiter);
+    return Pending;
+  }
+
+  // The writer of name is done, the claim stays if ok (the output has its final name) and is
+  // dropped otherwise. Returns the waiters that were added while the claim was pending.
+  std::vector<Waiter> finished(const std::string &name, bool ok) {
+    Shard &s = shard(name);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    std::vector<Waiter> waiters;
+    auto it = s.claims.find(name);
+    if (it == s.claims.end())
+      return waiters;
+    waiters.swap(it->second.waiters);
+    if (ok)
+      it->second.written = true;
+    else
+      s.claims.erase(it);
+    return waiters;
+  }
+
+  size_t size() {
+    size_t n = 0;
+    for (auto &s : shards) {
+      std::lock_guard<std::mutex> lock(s.mutex);
+      n += s.claims.size();
+    }
+    return n;
+  }
+
+private:
+  struct Claim {
+    bool written = false;
+    std::vector<Waiter> waiters;
+  };
+
+  struct alignas(64) Shard {
+    std::mutex mutex;
+    std::unordered_map<std::string, Claim> claims;
+  };
+
+  Shard &shard(const std::string &key) { return shards[std::hash<std::string>()(key) % shards.size()]; }
+
+  std::vector<Shard> shards;
+};
+
+#endif /* INCLUDE_UIDCACHE_HPP_ */
@@ -0,0 +1,79 @@
+#ifndef INCLUDE_UIDFORMAT_HPP_
+#define INCLUDE_UIDFORMAT_HPP_
+
+#include <cstring>
+#include <string>
+#include <string_view>
+
+#include "SHA-256.hpp"
+
+// The TeraRecon workstation rejects images with StudyInstanceUIDs that
+// do not contains some dots and numbers only. We should be closer to the
+// standard if we start with our organizational root.
+//
+// We still do not fulfil the standard (http://dicom.nema.org/dicom/2013/output/chtml/part05/chapter_9.html)
+// because only 0-9 characters are allowed.
+
+// We have a second case for UIDs outside the standard creating problems.
+// The Screenpoint software also tests for the standard on UIDs before the
+// any processing is done.
+
+// The two characters (high and low nibble) for every byte value of a digest.
+struct DigitPairs {
+  char pairs[256][2];
+  constexpr DigitPairs(const char *digits) : pairs() {
+    for (int i = 0; i < 256; i++) {
+      pairs[i][0] = digits[(i >> 4) & 0xf]; // high 4 bits
+      pairs[i][1] = digits[i & 0xf];        // low 4 bits
+    }
+  }
+};
+// old style: hexadecimal characters in UID (against standard for DICOM UIDs!)
+static constexpr DigitPairs hexPairs("0123456789abcdef");
+// new style replacing alphas with numeric characters,
+// stupid attempt because 0-5 will be more often in the data compared to 6-9
+static constexpr DigitPairs decPairs("0123456789012345");
+
+// A formatted UID or hash, at most 64 characters, kept on the stack of the caller.
+struct UIDBuffer {
+  char data[64];
+  size_t length = 0;
+  std::string_view view() const { return std::string_view(data, length); }
+};
+
+// Write the digest (64 characters) or our prefix + "." + digest into buf without any allocation.
+// With the prefix the UID is cut to 63 characters, bummer: this truncates our hash value, should be 64.
+inline std::string_view formatUID(const SHA256::digest &a, bool old_style_uid, bool withPrefix, UIDBuffer &buf) {
+  static const char prefix[] = "1.3.6.1.4.1.45037."; // organizational prefix for us
+  const DigitPairs &digits = old_style_uid ? hexPairs : decPairs;
+  size_t pos = 0;
+  size_t ndigits = 2 * SHA256::digest::size;
+  if (withPrefix) {
+    pos = sizeof(prefix) - 1;
+    memcpy(buf.data, prefix, pos);
+    ndigits = 63 - pos;
+  }
+  for (size_t i = 0; i < ndigits / 2; i++, pos += 2)
+    memcpy(buf.data + pos, digits.pairs[a.data[i]], 2);
+  if (ndigits & 1)
+    buf.data[pos++] = digits.pairs[a.data[ndigits / 2]][0];
+  buf.length = pos;
+  return buf.view();
+}
+
+// the digest as hexadecimal (old style) or as decimal-only characters
+inline std::string digestToString(const SHA256::digest &a, bool old_style_uid) {
+  UIDBuffer buf;
+  return std::string(formatUID(a, old_style_uid, false, buf));
+}
+
+inline std::string betterUID(const SHA256::digest &a, bool old_style_uid=false) {
+  UIDBuffer buf;
+  return std::string(formatUID(a, old_style_uid, true, buf));
+}
+
+inline std::string betterUID(std::string val, bool old_style_uid=false) {
+  return betterUID(SHA256::digestString(val), old_style_uid);
+}
+
+#endif /* INCLUDE_UIDFORMAT_HPP_ */